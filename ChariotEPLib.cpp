@@ -6,6 +6,11 @@
  */
  
 #include "ChariotEPLib.h"
+#ifdef __AVR__
+#include <avr/sleep.h>
+extern char __heap_start;
+extern char *__brkval;
+#endif
 
 #if UNO_HOST==1 || LEONARDO_HOST==1
 	SoftwareSerial ChariotClient(RX_PIN, TX_PIN);
@@ -15,27 +20,95 @@
 	#error Board type not supported by Chariot at this time--contact Tech Support.
 #endif
 
+ChariotEPClass *ChariotEPClass::links = NULL;
+uint32_t *ChariotEPClass::historyPool = NULL;
+uint8_t ChariotEPClass::historyPoolWords = 0;
+uint8_t ChariotEPClass::historyPoolUsed = 0;
+
+// The default link: ChariotClient with the shield's standard pins
 ChariotEPClass::ChariotEPClass()
+	: ChariotEPClass(ChariotClient, RSRC_EVENT_INT_PIN, CHARIOT_STATE_PIN)
+{
+#if CHARIOT_TRACE
+	traceStream.setLink(0);  // always trace link 0, however globals are ordered
+#endif
+}
+
+/*
+ * Additional links--e.g. a second shield on a MEGA:
+ *   ChariotEPClass ChariotEP2(Serial2, 7, 6);
+ * Each link has its own resource table, subscriptions and signal/state pins.
+ */
+ChariotEPClass::ChariotEPClass(HardwareSerial& transport, uint8_t signalPin, uint8_t statePin)
 {
+	hwClient = &transport;
+	swClient = NULL;
+	linkInit(transport, signalPin, statePin);
+}
+
+// NB: only one SoftwareSerial port can receive at a time.
+ChariotEPClass::ChariotEPClass(SoftwareSerial& transport, uint8_t signalPin, uint8_t statePin)
+{
+	hwClient = NULL;
+	swClient = &transport;
+	linkInit(transport, signalPin, statePin);
+}
+
+void ChariotEPClass::linkInit(Stream& transport, uint8_t signalPin, uint8_t statePin)
+{
+	client = &transport;
+#if CHARIOT_TRACE
+	traceStream.attach(transport);
+	client = &traceStream;
+#endif
+	this->signalPin = signalPin;
+	this->statePin = statePin;
+	nextLink = links;
+	links = this;
+	
+	begun = false;
+	debug = false;
 	chariotAvailable = false;
+	chariotState = LOW;
 	nextRsrcId = 0;
+	ramLowWater = 0x7FFF;
+	ramHandle = -1;
+	motionIntPin = -1;
+	motionHandle = -1;
+	motionCallback = NULL;
+	motionBusy = false;
+	motionDrained = 0;
+	motionDrops = 0;
+	tmp275Callback = NULL;
 }
 
+// Leave the list of links, so sleepUntilWork() never follows a dead one.
 ChariotEPClass::~ChariotEPClass()
 {
-	// do nothing
+	ChariotEPClass **link;
+	
+	for (link = &links; *link != NULL; link = &(*link)->nextLink) {
+		if (*link == this) {
+			*link = nextLink;
+			break;
+		}
+	}
 }
 
 boolean ChariotEPClass::begin() 
 {	
 #if LEONARDO_HOST
 #error Leonardo has been discontinued and is not support by Chariot
-	pinMode(RX_PIN, INPUT);
-	pinMode(TX_PIN, OUTPUT);
+	if (swClient == &ChariotClient) {
+		pinMode(RX_PIN, INPUT);
+		pinMode(TX_PIN, OUTPUT);
+	}
 	arduinoType	= LEONARDO;
 #elif UNO_HOST
-	pinMode(RX_PIN, INPUT);
-	pinMode(TX_PIN, OUTPUT);
+	if (swClient == &ChariotClient) {  // further links' ports set their own pins
+		pinMode(RX_PIN, INPUT);
+		pinMode(TX_PIN, OUTPUT);
+	}
 	arduinoType = UNO;
 #elif MEGA_DUE_HOST
 	arduinoType = MEGA_DUE;
@@ -46,7 +119,18 @@ boolean ChariotEPClass::begin()
 	/*
 	 * Start Chariot/Arduino channel
 	 */
-	ChariotClient.begin(9600);
+#if CHARIOT_TRACE
+	// Further links are numbered 1, 2... in the order the sketch begins them.
+	static uint8_t nextTraceLink = 1;
+	if (traceStream.getLink() == TRACE_LINK_UNSET) {
+		traceStream.setLink(nextTraceLink++);
+	}
+#endif
+	if (hwClient != NULL) {
+		hwClient->begin(9600);
+	} else {
+		swClient->begin(9600);
+	}
 	SerialMon.println(F("Chariot communication channel initialized."));
 	SerialMon.println(F("...waiting for Chariot to come online"));
 	
@@ -54,15 +138,17 @@ boolean ChariotEPClass::begin()
 	 * Set event pins and wait for Chariot to come up
 	 *     --Note: exints are active LOW--so set HIGH for init
 	 */
-	pinMode(RSRC_EVENT_INT_PIN, OUTPUT);
-	digitalWrite(RSRC_EVENT_INT_PIN, HIGH);
+	pinMode(signalPin, OUTPUT);
+	digitalWrite(signalPin, HIGH);
   
 	// This pin driven HIGH when Chariot is active
-	pinMode(CHARIOT_STATE_PIN, INPUT);
-	while (digitalRead(CHARIOT_STATE_PIN) == 0) {
+	pinMode(statePin, INPUT);
+	while (digitalRead(statePin) == 0) {
 		delay(50);
 		SerialMon.print(".");
 	}
+	chariotState = HIGH;
+	begun = true;
 	SerialMon.println(F("...Chariot online"));
 		
 	// Take Chariot's temp at startup and display.
@@ -73,9 +159,8 @@ boolean ChariotEPClass::begin()
 	SerialMon.println();
 	
 	// Wait for Chariot startup response.
-	if (!ChariotClient.available()) {
-		String Cmd = "sys/status<\n\0";
-		ChariotClient.print(Cmd);
+	if (!client->available()) {
+		client->print(F("sys/status<\n"));
 	}
 	chariotPrintResponse();	
 	chariotAvailable = true;
@@ -89,9 +174,16 @@ boolean ChariotEPClass::begin()
 		rsrcATTRs[i] = "";
 		putCallbacks[i] = NULL;
 		rsrcChariotBufSizes[i] = 0;
+		rsrcFormats[i] = JSON;
+		rsrcHistory[i] = HISTORY_NONE;
+	}
+	for (i=0; i<MAX_SUBSCRIPTIONS; i++) {
+		subCallbacks[i] = NULL;
 	}
 	
 	chariotAvailable = true;
+	sampleFreeRam();
+	return true;
 }
 
 uint8_t ChariotEPClass::getArduinoModel() { return arduinoType; }
@@ -100,7 +192,161 @@ void ChariotEPClass::disableDebugMsgs() { debug = false; }
 
 int ChariotEPClass::available()
 {
-	return ChariotClient.available();
+	return client->available();
+}
+
+Stream& ChariotEPClass::getTransport() { return *client; }
+
+/*
+ * Idle the MCU until the sketch has work to do: input from Chariot, a change
+ * on Chariot's state pin, Serial monitor input (debug only), queued
+ * ChariotI2C transactions or expiry of maxSleepMillis. Pass the time left to
+ * your next scheduled check, or 0 to sleep until one of the other events.
+ * Every begun Chariot link is watched, whichever one this is called on.
+ * Returns one of the WAKE_* reasons.
+ *
+ * AVR hosts use SLEEP_MODE_IDLE: the CPU clock stops but the UART, the
+ * SoftwareSerial pin change interrupt and Timer0 keep running, so arriving
+ * bytes wake us at once and millis() stays correct. The Timer0 tick also
+ * wakes us every ~1ms to sample the state pin, which has no interrupt of its
+ * own on MEGA. The ADC is switched off while asleep.
+ */
+uint8_t ChariotEPClass::sleepUntilWork(unsigned long maxSleepMillis)
+{
+	unsigned long started = millis();
+	ChariotEPClass *link;
+	
+	for (;;) {
+		if (linkInputPending()) {
+			return WAKE_CHARIOT;
+		}
+		for (link = links; link != NULL; link = link->nextLink) {
+			// INT1 is active low; once a drain is queued WAKE_I2C takes over
+			if ((link->motionIntPin >= 0) && !link->motionBusy && (digitalRead(link->motionIntPin) == LOW)) {
+				return WAKE_MOTION;
+			}
+			if (!link->begun) {
+				continue;  // its state pin may be floating
+			}
+			if (digitalRead(link->statePin) != link->chariotState) {
+				link->chariotState = !link->chariotState;
+				link->chariotAvailable = (link->chariotState == HIGH);
+				return WAKE_STATE_PIN;
+			}
+		}
+		if (debug && Serial.available()) {
+			return WAKE_SERIAL_MON;
+		}
+		if (ChariotI2C.ready()) {
+			return WAKE_I2C;
+		}
+		if (maxSleepMillis && ((millis() - started) >= maxSleepMillis)) {
+			return WAKE_TIMEOUT;
+		}
+		
+#ifdef __AVR__
+		uint8_t adcsra = ADCSRA;
+		ADCSRA &= ~_BV(ADEN);
+		set_sleep_mode(SLEEP_MODE_IDLE);
+		
+		// Interrupts stay off until the instruction after sei, so a byte
+		// arriving after this check still wakes the sleep_cpu() below.
+		noInterrupts();
+		if (!linkInputPending()) {
+			sleep_enable();
+			interrupts();
+			sleep_cpu();
+			sleep_disable();
+		}
+		interrupts();
+		ADCSRA = adcsra;
+#else
+		yield();
+#endif
+	}
+}
+
+bool ChariotEPClass::linkInputPending()
+{
+	ChariotEPClass *link;
+	
+	for (link = links; link != NULL; link = link->nextLink) {
+		if (link->begun && link->client->available()) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Bytes between the top of the heap and the stack. Fragments inside
+ * the heap are not counted, so this is what the next String can count on.
+ */
+int ChariotEPClass::freeRam()
+{
+#ifdef __AVR__
+	char top;
+	return &top - (__brkval ? __brkval : &__heap_start);
+#else
+	return -1;
+#endif
+}
+
+// Lowest freeRam() seen by process() and triggerResourceEvent() since begin().
+int ChariotEPClass::freeRamLowWater() { return ramLowWater; }
+
+void ChariotEPClass::sampleFreeRam()
+{
+	int ram = freeRam();
+	if (ram < ramLowWater) {
+		ramLowWater = ram;
+	}
+}
+
+/*
+ * Create event/sys/freeram and have process() publish {"free":n,"low":m}
+ * on it every publishMillis, and at once when the low-water mark drops.
+ * Returns its handle, or -1.
+ */
+int ChariotEPClass::freeRamResource(unsigned long publishMillis)
+{
+	if ((publishMillis == 0) || (ramHandle >= 0)) {
+		return -1;
+	}
+	ramHandle = createResource(F("event/sys/freeram"), MAX_BUFLEN-1, F("title=\"FreeRAM\?get|obs\""));
+	ramPublishMillis = publishMillis;
+	ramPublishedLow = 0x7FFF;  // first process() publishes
+	ramLastPublish = millis();
+	return ramHandle;
+}
+
+void ChariotEPClass::freeRamPublish()
+{
+	if ((ramHandle < 0) ||
+		((ramLowWater >= ramPublishedLow) && ((millis() - ramLastPublish) < ramPublishMillis))) {
+		return;
+	}
+	String ev = F("{\"free\":");
+	ev += freeRam();
+	ev += F(",\"low\":");
+	ev += ramLowWater;
+	ev += '}';
+	ramPublishedLow = ramLowWater;
+	ramLastPublish = millis();
+	triggerResourceEvent(ramHandle, ev, true);
+}
+
+/*
+ * RAM held by a resource: its table slot plus the heap copies of its URI
+ * and attributes (each String allocation carries a nul and a 2 byte malloc header).
+ */
+int ChariotEPClass::rsrcFootprint(int handle)
+{
+	if ((handle < 0) || (handle > (nextRsrcId-1))) {
+		return -1;
+	}
+	int history = (historyRing(handle) != NULL) ? 4*HISTORY_WORDS(historyRing(handle)->depth) : 0;
+	return RSRC_SLOT_BYTES + (rsrcURIs[handle].length() + 3) + (rsrcATTRs[handle].length() + 3) + history;
 }
 
 int ChariotEPClass::getIdFromURI(String& uri)
@@ -125,15 +371,20 @@ int ChariotEPClass::setPutHandler(int handle, String * (*putCallback)(String& pu
 		
 }
 
-int ChariotEPClass::createResource(String& uri, uint8_t bufLen, String& attrib)
+int ChariotEPClass::createResource(String& uri, uint8_t bufLen, String& attrib, uint8_t contentFormat, uint8_t historyDepth, int8_t historyExp)
 {
 	int rsrcNbr;
 	
-	if ((uri == NULL) || (bufLen == 0) || (bufLen > (MAX_BUFLEN-1)) || (attrib == NULL)) {
+	if ((uri == NULL) || (bufLen == 0) || (bufLen > (MAX_BUFLEN-1)) || (attrib == NULL) ||
+		((contentFormat != JSON) && (contentFormat != CBOR))) {
+		return -1;
+	}
+	if (!historyFits(historyDepth)) {
+		SerialMon.println(F("createResource: history pool exhausted"));
 		return -1;
 	}
 	
-	if (nextRsrcId == MAX_BUFLEN)
+	if (nextRsrcId >= MAX_RESOURCES)
 		return -1;
 		
 	rsrcNbr = nextRsrcId++;
@@ -149,19 +400,19 @@ int ChariotEPClass::createResource(String& uri, uint8_t bufLen, String& attrib)
 	rsrcString += String(uri);
 	rsrcString += "%attr=";
 	rsrcString += String(attrib);
+	if (contentFormat == CBOR) {
+		rsrcString += ";ct=60";  // declared to observers in the link attributes
+	}
 	rsrcString += "\n\0";
 
 	rsrcChariotBufSizes[rsrcNbr] = min(bufLen, MAX_BUFLEN);
+	rsrcFormats[rsrcNbr] = contentFormat;
 	
-	ChariotClient.print(rsrcString);
-    chariotSignal(RSRC_EVENT_INT_PIN);  // Publish Create via CoAP
+	client->print(rsrcString);
+    chariotSignal(signalPin);  // Publish Create via CoAP
       
-	while (ChariotClient.available() == 0) ;  // wait on response
 	// Parse this for result of last resource operation
-	String input = ChariotClient.readStringUntil('\r');
-	int terminator = input.indexOf("<<");
-	if (terminator != -1)
-		input.remove(terminator, 2);
+	String input = chariotReply();
 	SerialMon.print(input);
 	
 	int goodResponse = input.indexOf("chariot/2.01 CREATED");
@@ -171,21 +422,27 @@ int ChariotEPClass::createResource(String& uri, uint8_t bufLen, String& attrib)
 		return -1;
 	}
 	
+	historyAlloc(rsrcNbr, historyDepth, historyExp);
 	SerialMon.print(F("  "));
 	SerialMon.println(uri);
 	return rsrcNbr;
 }
 
 // use F("uri...") and F("attrib...") in your sketch to save memory for Uno and Leonardo
-int ChariotEPClass::createResource(const __FlashStringHelper* uri, uint8_t bufLen, const __FlashStringHelper* attrib)
+int ChariotEPClass::createResource(const __FlashStringHelper* uri, uint8_t bufLen, const __FlashStringHelper* attrib, uint8_t contentFormat, uint8_t historyDepth, int8_t historyExp)
 {
 	int rsrcNbr;
 	
-	if ((uri == NULL) || (bufLen == 0) || (bufLen > (MAX_BUFLEN-1)) || (attrib == NULL)) {
+	if ((uri == NULL) || (bufLen == 0) || (bufLen > (MAX_BUFLEN-1)) || (attrib == NULL) ||
+		((contentFormat != JSON) && (contentFormat != CBOR))) {
+		return -1;
+	}
+	if (!historyFits(historyDepth)) {
+		SerialMon.println(F("createResource: history pool exhausted"));
 		return -1;
 	}
 	
-	if (nextRsrcId == MAX_BUFLEN)
+	if (nextRsrcId >= MAX_RESOURCES)
 		return -1;
 		
 	rsrcNbr = nextRsrcId++;
@@ -201,19 +458,19 @@ int ChariotEPClass::createResource(const __FlashStringHelper* uri, uint8_t bufLe
 	rsrcString += String(uri);
 	rsrcString += "%attr=";
 	rsrcString += String(attrib);
+	if (contentFormat == CBOR) {
+		rsrcString += ";ct=60";
+	}
 	rsrcString += "<\n\0";
 
 	rsrcChariotBufSizes[rsrcNbr] = min(bufLen, MAX_BUFLEN);
+	rsrcFormats[rsrcNbr] = contentFormat;
 	   
-	ChariotClient.print(rsrcString);
-    chariotSignal(RSRC_EVENT_INT_PIN); 
+	client->print(rsrcString);
+    chariotSignal(signalPin); 
        
-	while (ChariotClient.available() == 0) ;  // wait on coap response
 	// Parse this for result of last resource operation
-	String input = ChariotClient.readStringUntil('\r');
-	int terminator = input.indexOf("<<");
-	if (terminator != -1)
-		input.remove(terminator, 2);
+	String input = chariotReply();
 	SerialMon.print(input);
 
 	if (!(input.length() >= 20) || !input.startsWith("chariot/2.01 CREATED", 0))
@@ -222,6 +479,7 @@ int ChariotEPClass::createResource(const __FlashStringHelper* uri, uint8_t bufLe
 		return -1;
 	}
 	
+	historyAlloc(rsrcNbr, historyDepth, historyExp);
 	SerialMon.print(F("    "));
 	SerialMon.println(String(uri));
 	return rsrcNbr;
@@ -230,7 +488,6 @@ int ChariotEPClass::createResource(const __FlashStringHelper* uri, uint8_t bufLe
 bool ChariotEPClass::triggerResourceEvent(int handle, String& eventVal, bool signalChariot)
 {
 	String ev = "";
-	String chariotResponse = "";
 	
 	if ((handle < 0) || (handle > (nextRsrcId-1))) {
 		SerialMon.print(F("Bad handle: "));
@@ -244,29 +501,71 @@ bool ChariotEPClass::triggerResourceEvent(int handle, String& eventVal, bool sig
 	ev += "value=";
 	ev += eventVal;
 	ev += "<\n\0";
-	if (ev.length() > rsrcChariotBufSizes[handle]) {
+	return rsrcEventSend(handle, ev, ev.length(), signalChariot);
+}
+
+/*
+ * Publish a CBOR encoded event. The serial link to Chariot is text framed,
+ * so the payload crosses it as hex ("rsrc=N%cbor=a2616e..."); Chariot
+ * turns it back into binary and serves it with content format 60. This
+ * needs Chariot firmware that knows the cbor= field. The hex doubles the
+ * line, which must stay within CHARIOT_LINE_MAX.
+ */
+bool ChariotEPClass::triggerResourceEvent(int handle, ChariotCBOR& eventVal, bool signalChariot)
+{
+	String ev = "";
+	const uint8_t *cbor = eventVal.data();
+	uint8_t i;
+	
+	if ((handle < 0) || (handle > (nextRsrcId-1)) || (rsrcFormats[handle] != CBOR) || eventVal.overflow()) {
+		SerialMon.print(F("Bad handle or CBOR event: "));
+		SerialMon.println(handle);
+		return false;
+	}
+	
+	ev = "rsrc=";
+	ev += handle;
+	ev += "%";
+	ev += "cbor=";
+	for (i = 0; i < eventVal.length(); i++) {
+		ev += (char)("0123456789abcdef"[cbor[i] >> 4]);
+		ev += (char)("0123456789abcdef"[cbor[i] & 0x0F]);
+	}
+	ev += "<\n\0";
+	if (ev.length() > CHARIOT_LINE_MAX) {
+		SerialMon.print(F("triggerResourceEvent: CBOR line of length: "));
+		SerialMon.print(ev.length());
+		SerialMon.print(F(" exceeds Chariot's line limit of: "));
+		SerialMon.println(CHARIOT_LINE_MAX);
+		return false;
+	}
+	// Chariot holds the decoded bytes, not the hex
+	return rsrcEventSend(handle, ev, ev.length() - eventVal.length(), signalChariot);
+}
+
+/*
+ * Send an event frame whose stored length on Chariot is evLen and wait for
+ * Chariot to accept it.
+ */
+bool ChariotEPClass::rsrcEventSend(int handle, String& ev, unsigned int evLen, bool signalChariot)
+{
+	String chariotResponse = "";
+	
+	sampleFreeRam();
+	if (evLen > rsrcChariotBufSizes[handle]) {
 		SerialMon.print(F("triggerResourceEvent: "));
 		SerialMon.print(ev);
 		SerialMon.print(F(" of length: "));
-		SerialMon.print(ev.length());
+		SerialMon.print(evLen);
 		SerialMon.print(F(" exceeds allowable length of: "));
 		SerialMon.println(rsrcChariotBufSizes[handle]);
 		return false;
 	}
 	// Send Chariot the resource state change
-	ChariotClient.print(ev); 
+	client->print(ev); 
 	
-	while (ChariotClient.available() == 0) ;  // wait on response
 	// Parse response for result of last resource operation
-	if (ChariotClient.available()) {
-		chariotResponse = ChariotClient.readStringUntil('\r');
-		int terminator = chariotResponse.indexOf("<<");
-		if (terminator != -1)
-			chariotResponse.remove(terminator, 2);
-	} else {
-		SerialMon.println(F("No response from Chariot"));
-		return false;
-	}
+	chariotResponse = chariotReply();
 
 	int goodResponse = chariotResponse.indexOf("CREATED");
 	if (goodResponse == -1)
@@ -284,22 +583,33 @@ bool ChariotEPClass::triggerResourceEvent(int handle, String& eventVal, bool sig
 	}
 	// Signal Chariot to notify all subscribers
 	if (signalChariot) {
-		chariotSignal(RSRC_EVENT_INT_PIN); 
+		chariotSignal(signalPin); 
 	}
 	return true;
 }
 
 /*----------------------------------------------------------------------*/
 void ChariotEPClass::process() 
+{
+  processCommand();
+  freeRamPublish();  // after the command's reply, never ahead of it
+}
+
+void ChariotEPClass::processCommand()
 {
   // read the command--terminate with '\n'
-  String command = ChariotClient.readStringUntil('\0');
+  String command = client->readStringUntil('\0');
   bool validCmd;
   
+  sampleFreeRam();
+  
   validCmd = command.startsWith(F("arduino/"), 0);
   if (!validCmd) {
 	validCmd = command.startsWith(F("event/"), 0);
   }
+  if (!validCmd) {
+	validCmd = command.startsWith(F("notify/"), 0);
+  }
   
   if (!validCmd) {
 	SerialMon.print(F("Unrecognized input from Chariot: "));
@@ -334,6 +644,20 @@ void ChariotEPClass::process()
 		modeCommand(command);
 		return; 
 	  }
+
+	  // is "sys" query?
+	  if (command.startsWith(F("sys/"), 0)) {
+		command.remove(0, 4);
+		sysCommand(command);
+		return; 
+	  }
+	  return;
+  }
+
+  // is notification from a remote resource we subscribed to?
+  else if (command.startsWith(F("notify/"), 0)) {
+	  command.remove(0, 7);
+	  notifyCommand(command);
 	  return;
   }
 
@@ -360,6 +684,10 @@ void ChariotEPClass::process()
 		}
 		
 		id = getIdFromURI(command);
+		if ((id != -1) && ((param == "history") || param.startsWith(F("history=")) || param.startsWith(F("history&")))) {
+			historyCommand(id, param);
+			return;
+		}
 		if ((id != -1) && (putCallbacks[id] != NULL) &&( param != ""))
 		{
 			String *Str;
@@ -383,131 +711,457 @@ void ChariotEPClass::process()
   }
 }
 
-int ChariotEPClass::coapResponseGet(String& response)
+/*-----------------------------------------------------------------------------------------------*/
+/* Resource history                                                                              */
+/*-----------------------------------------------------------------------------------------------*/
+ChariotEPClass::HistoryRing *ChariotEPClass::historyRing(int handle)
 {
-  char ch;
-  uint8_t ltSeen = 0;
-
-  response = "";
-  while (ltSeen < 2) {
-    if (ChariotClient.available() > 0) {
-      ch = (char)ChariotClient.read();
-  
-      if (ch != '<') {
-        response += ch;
-      }
-      else {
-        ltSeen++;
-      }
-    }
-  }
-  return ChariotClient.available();
+	if (rsrcHistory[handle] == HISTORY_NONE) {
+		return NULL;
+	}
+	return (HistoryRing *)&historyPool[rsrcHistory[handle]];
 }
 
-void ChariotEPClass::digitalCommand(String& command) {
-  int pin, value;
-   String response;
-
-  // Read pin number
-  if (pinValParse(command, &pin, &value)) {
-  
-#if EP_DEBUG 
-    SerialMon.print(F("pin="));
-    SerialMon.println(pin, DEC);
-#endif
-
-    // If value is not -1 it means we have an URL
-    // with a value like: "/digital/13/1"
-    if (value >= 0) {
-#if EP_DEBUG 
-      SerialMon.println(F("command is WRITE"));
-#endif
-	  if (value > 1)
-		goto error;
-		
-      digitalWrite(pin, value);
-    }
-    else {
-      value = digitalRead(pin);
-#if EP_DEBUG 
-      SerialMon.println(F("command is READ"));
-#endif
-    }
-  
-    // Send pin response to requestor
-    response = "Pin D";
-    response += pin;
-    response += " set to ";
-    response += value;
-    response += "<\n\0";
-    ChariotClient.print(response);
-  
-#if EP_DEBUG 
-    SerialMon.println(response);
-#endif
-    return;
-  }
-error: // Pin value not available.
-  SerialMon.print(F("digital command--pin values incorrect or missing. Pin = "));
-  SerialMon.print(pin);
-  SerialMon.print(F(" Value = "));
-  SerialMon.println(value);
-  SerialMon.println(F("Operation cancelled."));
-  // Return response
-  ChariotClient.print(F("Arduino could not complete digital pin request.<\n\0"));
+// Characters print() takes for v, so a reply can be measured before it is sent.
+static uint8_t decimalLen(long v)
+{
+	uint8_t len = (v < 0) ? 2 : 1;
+	
+	if (v < 0) {
+		v = -v;
+	}
+	while (v >= 10) {
+		v /= 10;
+		len++;
+	}
+	return len;
 }
 
-void ChariotEPClass::analogCommand(String& command) {
-  int pin, value;
-  String response;
+bool ChariotEPClass::historyFits(uint8_t depth)
+{
+	return (depth == 0) || (historyPoolUsed + HISTORY_WORDS(depth) <= historyPoolWords);
+}
 
-  // Read pin number
-  if (pinValParse(command, &pin, &value)) {
+/*
+ * Hand the library the RAM its history rings are carved from, before the
+ * first createResource() that asks for one, e.g.
+ *   static uint32_t historyStore[16];
+ *   ChariotEP.setHistoryPool(historyStore, sizeof(historyStore));
+ * No pool, no history--sketches that don't keep any pay nothing for it.
+ * Offsets are kept in a byte, so at most 1020 bytes are used.
+ */
+bool ChariotEPClass::setHistoryPool(uint32_t *pool, uint16_t bytes)
+{
+	if (historyPoolUsed) {
+		return false;  // rings already carved from the old pool
+	}
+	historyPool = pool;
+	historyPoolWords = (pool != NULL) ? min(bytes/4, HISTORY_NONE) : 0;
+	return true;
+}
 
-#if EP_DEBUG 
-  SerialMon.print(F("pin="));
-  SerialMon.println(pin, DEC);
-#endif
+// Rings are never freed--like the resources on Chariot they last until reset.
+void ChariotEPClass::historyAlloc(int handle, uint8_t depth, int8_t exp)
+{
+	HistoryRing *ring;
+	
+	if (depth == 0) {
+		return;
+	}
+	rsrcHistory[handle] = historyPoolUsed;
+	historyPoolUsed += HISTORY_WORDS(depth);
+	ring = historyRing(handle);
+	ring->newest = 0;
+	ring->depth = depth;
+	ring->head = 0;
+	ring->count = 0;
+	ring->exp = exp;
+}
 
-  // Write is requested with a value like: "/analog/5/120"
-	if (value >= 0) {
-#if EP_DEBUG 
-		SerialMon.println(F("command is WRITE"));
-#endif
-		analogWrite(pin, value);
+/*
+ * Keep value in the resource's history ring, overwriting the oldest sample
+ * when full. Values are kept as val x 10^exp, exp from createResource(),
+ * and clamped to +/-32767 x 10^exp (+/-327.67 at the default -2); gaps
+ * are kept in whole seconds, up to about 18 hours.
+ */
+bool ChariotEPClass::recordHistory(int handle, float value)
+{
+	HistoryRing *ring;
+	HistorySample *sample;
+	unsigned long now = millis();
+	unsigned long secs = 0;
+	float scaled = value;
+	int8_t e;
+	
+	if ((handle < 0) || (handle > (nextRsrcId-1)) || ((ring = historyRing(handle)) == NULL)) {
+		return false;
 	}
-	else {
-		value = analogRead(pin);
-#if EP_DEBUG 
-  SerialMon.println(F("command is READ"));
-#endif
+	for (e = ring->exp; e < 0; e++) {
+		scaled *= 10;
+	}
+	for (; e > 0; e--) {
+		scaled /= 10;
+	}
+	if (ring->count) {
+		secs = (now - ring->newest) / 1000;
+		ring->newest += secs * 1000;  // carry the remainder so gaps don't drift
+	} else {
+		ring->newest = now;
+	}
+	
+	sample = (HistorySample *)(ring + 1) + ring->head;
+	scaled = constrain(scaled, -32767.0, 32767.0);
+	sample->val = (int16_t)((scaled < 0) ? (scaled - 0.5) : (scaled + 0.5));
+	sample->dt = (uint16_t)min(secs, 0xFFFFUL);
+	ring->head = (ring->head + 1) % ring->depth;
+	if (ring->count < ring->depth) {
+		ring->count++;
 	}
+	return true;
+}
 
-	// Send pin response to requestor
-	response = "Pin A";
-	response += pin;
-	response += " set to ";
-	response += value;
-	response += "<\n\0";
-	ChariotClient.print(response);
-  
-#if EP_DEBUG 
-  SerialMon.println(response);
-#endif
-  } else { // Pin value not available.
-	SerialMon.print(F("analog command--pin values incorrect or missing. Pin = "));
+/*
+ * PUT history=N&from=K to the resource: up to N samples (all if N is
+ * absent), newest first, skipping the K newest. The reply is one line, as
+ * for any PUT:
+ *   {"of":C,"e":E,"age":s,"h":[v,dt,v,dt...]}
+ * C samples are held, value = v x 10^E, age is the seconds since the newest
+ * sample and dt the seconds back to the next (0 for the oldest). Only as
+ * many samples as fit in CHARIOT_LINE_MAX are sent; ask again with
+ * from=K+sent for the rest.
+ */
+void ChariotEPClass::historyCommand(int handle, String& param)
+{
+	ChariotWriter response(*client);
+	HistoryRing *ring = historyRing(handle);
+	HistorySample *samples;
+	int n, from, i, idx;
+	uint16_t dt;
+	unsigned int used, pairLen;
+	
+	if (ring == NULL) {
+		response.print(F("Arduino remote error: resource keeps no history\n"));
+		response.flush();
+		return;
+	}
+	samples = (HistorySample *)(ring + 1);
+	n = ring->count;
+	if (param.startsWith(F("history=")) && (atoi(param.c_str() + 8) > 0)) {
+		n = min(n, atoi(param.c_str() + 8));
+	}
+	from = param.indexOf(F("from="));
+	from = (from != -1) ? constrain(atoi(param.c_str() + from + 5), 0, ring->count) : 0;
+	n = min(n, ring->count - from);
+	
+	used = response.print(F("{\"of\":"));
+	used += response.print(ring->count);
+	used += response.print(F(",\"e\":"));
+	used += response.print(ring->exp);
+	used += response.print(F(",\"age\":"));
+	used += response.print(ring->count ? (millis() - ring->newest) / 1000 : 0);
+	used += response.print(F(",\"h\":["));
+	
+	for (i = from; i < from + n; i++) {
+		idx = (ring->head + ring->depth - 1 - i) % ring->depth;
+		dt = (i == ring->count - 1) ? 0 : samples[idx].dt;
+		pairLen = (i != from) + decimalLen(samples[idx].val) + 1 + decimalLen(dt);
+		if (used + pairLen + 3 > CHARIOT_LINE_MAX) {
+			break;  // "]}\n" must still fit
+		}
+		if (i != from) {
+			response.print(',');
+		}
+		response.print(samples[idx].val);
+		response.print(',');
+		response.print(dt);
+		used += pairLen;
+	}
+	response.print(F("]}\n"));
+	response.flush();
+}
+
+/*
+ * Observe a resource on another mote, e.g.
+ *   coap://chariot.c3511.local/event/tmp275-c/trigger
+ * Chariot registers the observe and relays each notification to us as
+ * "notify/<handle>&<value>", which process() hands to notifyCallback.
+ * Peers react in one mesh hop, without a webapp relaying PUTs.
+ * Needs Chariot firmware that knows sub=/unsub= and sends notify/ frames;
+ * the bundled chariot-coap-client-server.elf does not, and subscribe()
+ * fails after CHARIOT_REPLY_MILLIS unanswered.
+ * Returns the subscription handle, or -1.
+ */
+int ChariotEPClass::subscribe(String& remoteUri, void (*notifyCallback)(String& value))
+{
+	return subscribeSend(remoteUri, notifyCallback);
+}
+
+int ChariotEPClass::subscribe(const __FlashStringHelper* remoteUri, void (*notifyCallback)(String& value))
+{
+	String uri = remoteUri;
+	return subscribeSend(uri, notifyCallback);
+}
+
+int ChariotEPClass::subscribeSend(String& remoteUri, void (*notifyCallback)(String& value))
+{
+	int subNbr;
+	
+	if ((notifyCallback == NULL) || (remoteUri.length() == 0)) {
+		return -1;
+	}
+	for (subNbr = 0; subNbr < MAX_SUBSCRIPTIONS; subNbr++) {
+		if (subCallbacks[subNbr] == NULL)
+			break;
+	}
+	if (subNbr == MAX_SUBSCRIPTIONS) {
+		SerialMon.println(F("subscribe: no free subscription slots"));
+		return -1;
+	}
+	
+	String subString = "sub=";
+	subString += subNbr;
+	subString += "%uri=";
+	subString += remoteUri;
+	subString += "<\n\0";
+	client->print(subString);
+	chariotSignal(signalPin);
+	
+	if (!chariotCreated()) {
+		return -1;
+	}
+	subCallbacks[subNbr] = notifyCallback;
+	SerialMon.print(F("  subscribed to "));
+	SerialMon.println(remoteUri);
+	return subNbr;
+}
+
+// Cancel the observe; the slot is freed even if Chariot no longer knew it.
+bool ChariotEPClass::unsubscribe(int subHandle)
+{
+	bool ok;
+	
+	if ((subHandle < 0) || (subHandle >= MAX_SUBSCRIPTIONS) || (subCallbacks[subHandle] == NULL)) {
+		return false;
+	}
+	String unsubString = "unsub=";
+	unsubString += subHandle;
+	unsubString += "<\n\0";
+	client->print(unsubString);
+	chariotSignal(signalPin);
+	
+	ok = chariotCreated();
+	subCallbacks[subHandle] = NULL;
+	return ok;
+}
+
+void ChariotEPClass::notifyCommand(String& command)
+{
+	int paramStart = command.indexOf('&');
+	int subHandle;
+	
+	if (paramStart == -1) {
+		SerialMon.println(F("Notification value did not arrive"));
+		return;
+	}
+	subHandle = command.toInt();  // stops at the '&'
+	command.remove(0, paramStart+1);
+	command.trim();
+	
+	if ((subHandle >= 0) && (subHandle < MAX_SUBSCRIPTIONS) && (subCallbacks[subHandle] != NULL)) {
+		subCallbacks[subHandle](command);
+	}
+}
+
+// Wait for Chariot's answer to a resource/subscription request
+bool ChariotEPClass::chariotCreated()
+{
+	String input = chariotReply();
+	SerialMon.print(input);
+	
+	return (input.indexOf("CREATED") != -1);
+}
+
+/*
+ * Wait for Chariot's reply line, without its "<<". Notifications from
+ * subscribe() may arrive first; they are handed to their callbacks and
+ * the wait goes on for the reply itself. Empty if Chariot does not start
+ * answering within CHARIOT_REPLY_MILLIS--firmware that doesn't know a
+ * request may never answer it.
+ */
+String ChariotEPClass::chariotReply()
+{
+	String input = "";
+	unsigned long lastByte;
+	int c;
+	
+	if (!chariotAwait()) {
+		SerialMon.println(F("Chariot did not reply"));
+		return input;
+	}
+	lastByte = millis();
+	while ((millis() - lastByte) < 1000) {  // Stream's timeout between bytes
+		if (client->available() == 0) {
+			continue;
+		}
+		c = client->read();
+		lastByte = millis();
+		if (c == '\r') {
+			break;
+		}
+		if ((c == '\0') && input.startsWith(F("notify/"))) {
+			input.remove(0, 7);
+			notifyCommand(input);
+			input = "";
+			if (!chariotAwait()) {  // the reply is still to come
+				SerialMon.println(F("Chariot did not reply"));
+				return input;
+			}
+			lastByte = millis();
+			continue;
+		}
+		input += (char)c;
+	}
+	
+	int terminator = input.indexOf("<<");
+	if (terminator != -1)
+		input.remove(terminator, 2);
+	return input;
+}
+
+bool ChariotEPClass::chariotAwait()
+{
+	unsigned long started = millis();
+	
+	while (client->available() == 0) {
+		if ((millis() - started) >= CHARIOT_REPLY_MILLIS) {
+			return false;
+		}
+	}
+	return true;
+}
+
+int ChariotEPClass::coapResponseGet(String& response)
+{
+  char ch;
+  uint8_t ltSeen = 0;
+
+  response = "";
+  while (ltSeen < 2) {
+    if (client->available() > 0) {
+      ch = (char)client->read();
+  
+      if ((ch == '\0') && response.startsWith(F("notify/"))) {
+        response.remove(0, 7);  // a notification, not our response
+        notifyCommand(response);
+        response = "";
+      } else if (ch != '<') {
+        response += ch;
+      }
+      else {
+        ltSeen++;
+      }
+    }
+  }
+  return client->available();
+}
+
+void ChariotEPClass::digitalCommand(String& command) {
+  int pin = -1, value = -1;
+  ChariotWriter response(*client);
+
+  // Read pin number
+  if (pinValParse(command, &pin, &value)) {
+  
+#if EP_DEBUG 
+    SerialMon.print(F("pin="));
+    SerialMon.println(pin, DEC);
+#endif
+
+    // If value is not -1 it means we have an URL
+    // with a value like: "/digital/13/1"
+    if (value >= 0) {
+#if EP_DEBUG 
+      SerialMon.println(F("command is WRITE"));
+#endif
+	  if (value > 1)
+		goto error;
+		
+      digitalWrite(pin, value);
+    }
+    else {
+      value = digitalRead(pin);
+#if EP_DEBUG 
+      SerialMon.println(F("command is READ"));
+#endif
+    }
+  
+    // Send pin response to requestor
+    response.print(F("Pin D"));
+    response.print(pin);
+    response.print(F(" set to "));
+    response.print(value);
+    response.endFrame();
+    return;
+  }
+error: // Pin value not available.
+  SerialMon.print(F("digital command--pin values incorrect or missing. Pin = "));
+  SerialMon.print(pin);
+  SerialMon.print(F(" Value = "));
+  SerialMon.println(value);
+  SerialMon.println(F("Operation cancelled."));
+  // Return response
+  response.print(F("Arduino could not complete digital pin request."));
+  response.endFrame();
+}
+
+void ChariotEPClass::analogCommand(String& command) {
+  int pin = -1, value = -1;
+  ChariotWriter response(*client);
+
+  // Read pin number
+  if (pinValParse(command, &pin, &value)) {
+
+#if EP_DEBUG 
+  SerialMon.print(F("pin="));
+  SerialMon.println(pin, DEC);
+#endif
+
+  // Write is requested with a value like: "/analog/5/120"
+	if (value >= 0) {
+#if EP_DEBUG 
+		SerialMon.println(F("command is WRITE"));
+#endif
+		analogWrite(pin, value);
+	}
+	else {
+		value = analogRead(pin);
+#if EP_DEBUG 
+  SerialMon.println(F("command is READ"));
+#endif
+	}
+
+	// Send pin response to requestor
+	response.print(F("Pin A"));
+	response.print(pin);
+	response.print(F(" set to "));
+	response.print(value);
+	response.endFrame();
+  } else { // Pin value not available.
+	SerialMon.print(F("analog command--pin values incorrect or missing. Pin = "));
 	SerialMon.print(pin);
 	SerialMon.print(F(" Value = "));
 	SerialMon.println(value);
 	SerialMon.println(F("Operation cancelled."));
 	// Return response
-	ChariotClient.print(F("Arduino could not complete analog pin request.<\n\0"));
+	response.print(F("Arduino could not complete analog pin request."));
+	response.endFrame();
   }
 }
 
 void ChariotEPClass::modeCommand(String& command) {
-  int pin; int value;
-  String response, mode;
+  int pin = -1; int value = -1;
+  const __FlashStringHelper *mode;
+  ChariotWriter response(*client);
 
   // Read pin number and mode to set
   if (pinValParse(command, &pin, &value)) {
@@ -521,13 +1175,13 @@ void ChariotEPClass::modeCommand(String& command) {
 
   if (value == INPUT) {
     pinMode(pin, INPUT);
-	mode = "INPUT";
+	mode = F("INPUT");
   } else if (value  == OUTPUT) {
     pinMode(pin, OUTPUT);
-	mode = "OUTPUT";
+	mode = F("OUTPUT");
   } else if (value == INPUT_PULLUP) {
     pinMode(pin, INPUT_PULLUP);
-	mode = "INPUT_PULLUP";
+	mode = F("INPUT_PULLUP");
   } else {
 	goto mode_error;
   }
@@ -538,22 +1192,43 @@ void ChariotEPClass::modeCommand(String& command) {
 #endif
 
     // Send pin response to requestor
-    response = "Pin D";
-    response += pin;
-    response += " configured as ";
-    response += mode;
-    response += "<\n\0";
-    ChariotClient.print(response);
+    response.print(F("Pin D"));
+    response.print(pin);
+    response.print(F(" configured as "));
+    response.print(mode);
+    response.endFrame();
     return;
   }
 #if EP_DEBUG 
   SerialMon.print(F("Arduino remote error: invalid mode requested: "));
-  SerialMon.println(mode);
+  SerialMon.println(value);
 #endif
 mode_error:
-  ChariotClient.print(F("Arduino remote error: invalid mode "));
-  ChariotClient.print(mode);
-  ChariotClient.print("<\n\0");
+  response.print(F("Arduino remote error: invalid mode "));
+  response.print(value);
+  response.endFrame();
+}
+
+/*
+ * Arduino system resources--
+ *   arduino/sys/freeram  free RAM now and its low-water mark, in bytes
+ * The bundled Chariot firmware routes only arduino/digital, analog and mode
+ * to us; on it, publish with freeRamResource() instead.
+ */
+void ChariotEPClass::sysCommand(String& command) {
+  ChariotWriter response(*client);
+
+  if (command.startsWith(F("freeram"), 0)) {
+	response.print(F("{\"free\":"));
+	response.print(freeRam());
+	response.print(F(",\"low\":"));
+	response.print(ramLowWater);
+	response.print('}');
+	response.endFrame();
+	return;
+  }
+  response.print(F("Arduino remote error: unknown sys resource"));
+  response.endFrame();
 }
 
 /**
@@ -625,10 +1300,14 @@ void ChariotEPClass::chariotPrintResponse()
   uint8_t ltSeen = 0;
   
   while (ltSeen < 2) {
-    if (ChariotClient.available() > 0) {
-      ch = (char)ChariotClient.read();
+    if (client->available() > 0) {
+      ch = (char)client->read();
   
-      if (ch != '<') {
+      if ((ch == '\0') && response.startsWith(F("notify/"))) {
+        response.remove(0, 7);  // a notification, not our response
+        notifyCommand(response);
+        response = "";
+      } else if (ch != '<') {
         response += ch;
       }
       else {
@@ -640,9 +1319,9 @@ void ChariotEPClass::chariotPrintResponse()
 #else
 	int terminator;
 	
-	while (ChariotClient.available());
-	while (ChariotClient.available() > 0) {
-		response = ChariotClient.readStringUntil('\n');
+	while (client->available());
+	while (client->available() > 0) {
+		response = client->readStringUntil('\n');
 		terminator = response.indexOf("<<");
 		if (terminator != -1) {
 			response.remove(terminator, 2);
@@ -669,10 +1348,9 @@ void ChariotEPClass::serialChariotCmd()
     len++;
    
     /**
-     * End of line input reached--trim whitespace and nul terminate
+     * End of line input reached
      */
     if (newChar == LF) {
-      chariotLclCmd += (char)'\0';
       terminator_seen = true;
     }
 
@@ -682,37 +1360,49 @@ void ChariotEPClass::serialChariotCmd()
   }
 
   // Process commands
-  String Cmd;
+  ChariotWriter cmd(*client);
 	
   if (chariotLclCmd == "help") {
 	serialChariotCmdHelp();
 	return;
   }
 
+  if (chariotLclCmd == "mem") {
+	memReport();
+	return;
+  }
+
+#if CHARIOT_TRACE
+  if (chariotLclCmd == "trace") {
+	ChariotTrace.dump(Serial);
+	return;
+  }
+  if (chariotLclCmd == "trace clear") {
+	ChariotTrace.clear();
+	return;
+  }
+#endif
+
   if  ((chariotLclCmd == "motes") || (chariotLclCmd == "hosts") || (chariotLclCmd == "health"))
   { 
-	Cmd = "sys/";
-	Cmd += chariotLclCmd;
-	Cmd += "<\n\0";
-	ChariotClient.print(Cmd);
+	cmd.print(F("sys/"));
+	cmd.print(chariotLclCmd);
+	cmd.endFrame();
     chariotPrintResponse();
   }
   else if ((chariotLclCmd == "radio") || (chariotLclCmd == "temp") || (chariotLclCmd == "accel")) 
   {
-    Cmd = "sensors/";
-	Cmd += chariotLclCmd;
-	Cmd += "<\n\0";
-	
-	ChariotClient.print(Cmd);
+	cmd.print(F("sensors/"));
+	cmd.print(chariotLclCmd);
+	cmd.endFrame();
     chariotPrintResponse();
   } else if ((chariotLclCmd.startsWith("chan", 0)) || (chariotLclCmd.startsWith("txpwr", 0)) ||
 			(chariotLclCmd.startsWith("panid", 0)) || (chariotLclCmd.startsWith("panaddr", 0)))
   {
-	Cmd = "sys/";
-	Cmd += chariotLclCmd;
-	Cmd += "<\n\0";
-	ChariotClient.print(Cmd);
-	while(ChariotClient.available() == 0) ;
+	cmd.print(F("sys/"));
+	cmd.print(chariotLclCmd);
+	cmd.endFrame();
+	while(client->available() == 0) ;
     chariotPrintResponse();
   } 
 #if EP_DEBUG
@@ -733,6 +1423,10 @@ void ChariotEPClass::serialChariotCmdHelp()
 	SerialMon.println(F("health -- display status, Chariot console info, DNS name"));
 	SerialMon.println(F("radio  -- display RF signal quality parameters LQI and RSSI"));
 	SerialMon.println(F("temp   -- display board temp in Celsius"));
+	SerialMon.println(F("mem    -- display Arduino RAM budget and free RAM low-water mark"));
+#if CHARIOT_TRACE
+	SerialMon.println(F("trace  -- dump Chariot link trace; \"trace clear\" empties it"));
+#endif
 	SerialMon.println(F("chan or chan=[11..26] get or set 802.11.4 comm channel (26 is default)"));
 	SerialMon.println(F("txpwr or txpwr=[0..15], 0 being the highest setting"));
 	SerialMon.println(F("panid or panid=\"0x\" + up to 4 hex digits, not all \"F\""));
@@ -740,50 +1434,1100 @@ void ChariotEPClass::serialChariotCmdHelp()
 	SerialMon.println();
 }
 
+void ChariotEPClass::memReport()
+{
+	int i;
+	
+	SerialMon.println();
+	SerialMon.print(F("Resource table: "));
+	SerialMon.print(MAX_RESOURCES);
+	SerialMon.print(F(" slots x "));
+	SerialMon.print(RSRC_SLOT_BYTES);
+	SerialMon.print(F("B = "));
+	SerialMon.print(MAX_RESOURCES*RSRC_SLOT_BYTES);
+	SerialMon.print(F("B of "));
+	SerialMon.print(RSRC_RAM_BUDGET);
+	SerialMon.println(F("B budget"));
+	for (i=0; i < nextRsrcId; i++) {
+		SerialMon.print(F("  "));
+		SerialMon.print(rsrcURIs[i]);
+		SerialMon.print(F(": "));
+		SerialMon.print(rsrcFootprint(i));
+		SerialMon.println('B');
+	}
+	SerialMon.print(F("History pool: "));
+	SerialMon.print(4*historyPoolUsed);
+	SerialMon.print(F("B of "));
+	SerialMon.print(4*historyPoolWords);
+	SerialMon.println(F("B (the sketch's)"));
+	SerialMon.print(F("Library static RAM: "));
+	SerialMon.print(CHARIOT_STATIC_BYTES);
+	SerialMon.print(F("B of "));
+	SerialMon.print(CHARIOT_RAM_BUDGET);
+	SerialMon.println(F("B budget"));
+	SerialMon.print(F("  link: "));
+	SerialMon.print(sizeof(ChariotEPClass));
+	SerialMon.print(F("B (motion buffer "));
+	SerialMon.print(sizeof(motionBuf));
+	SerialMon.print(F("B), I2C queue: "));
+	SerialMon.print(sizeof(ChariotI2CClass));
+	SerialMon.print(F("B, trace: "));
+	SerialMon.print(CHARIOT_TRACE_BYTES);
+	SerialMon.println('B');
+	SerialMon.print(F("Free RAM: "));
+	SerialMon.print(freeRam());
+	SerialMon.print(F("B, low-water mark: "));
+	SerialMon.print(ramLowWater);
+	SerialMon.println('B');
+	SerialMon.println();
+}
+
 /*-----------------------------------------------------------------------------------------------*/
 /* There isn't a really good reason for this to be here. A separate sensors class should be used.*/
 /* --although TMP275 is in the EP...                                                             */
 /*-----------------------------------------------------------------------------------------------*/
-float ChariotEPClass::readTMP275(uint8_t units)
+static float tmp275Convert(uint8_t tempHighByte, uint8_t tempLowByte, uint8_t units)
 {
-  char tempHighByte, tempLowByte;
   double temperature;
   long t;
 
-#ifndef I_AM_EXCLUSIVE_I2C_OWNER
-  // init I2C
-  Wire.begin();
-#endif
-  Wire.beginTransmission(TMP275_ADDRESS);
-  Wire.write(1);
-  Wire.write(B11100001);
-  Wire.endTransmission();
-  Wire.beginTransmission(TMP275_ADDRESS);
-  Wire.write(0);
-  Wire.endTransmission();
-  Wire.requestFrom(TMP275_ADDRESS,2);
-  delay(250);
-  tempHighByte = Wire.read();
-  tempLowByte  = Wire.read();
-
   t = word(tempHighByte,tempLowByte)/16;
   temperature = (t/10)*625; // TMP275 is accurate to .0625C
   temperature /= 1000.0;
   
 #define TMP275_TRIGGER_DEBUG (0)
 #if TMP275_TRIGGER_DEBUG
-SerialMon.print(F("TMP275 bits: "));
-SerialMon.print(t, BIN); Serial.print("  0x"); Serial.println(t, HEX);
+Serial.print(F("TMP275 bits: "));
+Serial.print(t, BIN); Serial.print("  0x"); Serial.println(t, HEX);
 #endif
 
   if (units == FAHRENHEIT) {
       temperature = temperature*1.8 + 32.0;
   } 
-  Wire.endTransmission(true); // Let go of the bus
-#ifndef I_AM_EXCLUSIVE_I2C_OWNER
-  // terminate I2C
-  Wire.end();
-#endif
   return (float)temperature;
 }
-ChariotEPClass ChariotEP; // Create an object
\ No newline at end of file
+
+float ChariotEPClass::readTMP275(uint8_t units)
+{
+  const uint8_t config[2] = { 1, B11100001 };  // 12 bit, one-shot
+  const uint8_t tempReg = 0;
+  uint8_t temp[2] = { 0, 0 };
+
+  ChariotI2C.transfer(TMP275_ADDRESS, config, 2, NULL, 0);
+  delay(TMP275_CONV_MILLIS);
+  ChariotI2C.transfer(TMP275_ADDRESS, &tempReg, 1, temp, 2);
+  return tmp275Convert(temp[0], temp[1], units);
+}
+
+/*
+ * Queue a TMP275 read on ChariotI2C; tempCallback gets Celsius once
+ * ChariotI2C.poll() has started a conversion and, TMP275_CONV_MILLIS later,
+ * read its result. Returns false if the queue is full or a read is already
+ * outstanding.
+ */
+bool ChariotEPClass::requestTMP275(void (*tempCallback)(float celsius))
+{
+  const uint8_t config[2] = { 1, B11100001 };
+
+  if ((tempCallback == NULL) || (tmp275Callback != NULL))
+	return false;
+  if (ChariotI2C.submit(TMP275_ADDRESS, config, 2, NULL, 0, tmp275I2CStarted, this) < 0)
+	return false;
+  tmp275Callback = tempCallback;
+  return true;
+}
+
+// The one-shot is running: read the result once it is done.
+void ChariotEPClass::tmp275I2CStarted(uint8_t status, uint8_t *data, uint8_t len, void *ctx)
+{
+  ChariotEPClass *ep = (ChariotEPClass *)ctx;
+  const uint8_t tempReg = 0;
+
+  (void)data; (void)len;
+  if ((status != I2C_OK) ||
+	  (ChariotI2C.submit(TMP275_ADDRESS, &tempReg, 1, ep->tmp275Buf, 2, tmp275I2CDone, ep, TMP275_CONV_MILLIS) < 0)) {
+	ep->tmp275Callback = NULL;
+  }
+}
+
+void ChariotEPClass::tmp275I2CDone(uint8_t status, uint8_t *data, uint8_t len, void *ctx)
+{
+  ChariotEPClass *ep = (ChariotEPClass *)ctx;
+  void (*cb)(float celsius) = ep->tmp275Callback;
+
+  ep->tmp275Callback = NULL;
+  if ((status == I2C_OK) && (len == 2) && (cb != NULL))
+	cb(tmp275Convert(data[0], data[1], CELSIUS));
+}
+
+/*-----------------------------------------------------------------------------------------------*/
+/* FXOS8700CQ accelerometer/magnetometer. Accel samples collect in the sensor's 32 deep FIFO and  */
+/* are drained in burst reads once the watermark is reached, so 100+ Hz motion costs the sketch   */
+/* a few I2C transfers per watermark instead of one per sample.                                   */
+/*-----------------------------------------------------------------------------------------------*/
+#define FXOS_F_STATUS			0x00
+#define FXOS_OUT_X_MSB			0x01
+#define FXOS_F_SETUP			0x09
+#define FXOS_INT_SOURCE			0x0C
+#define FXOS_WHO_AM_I			0x0D
+#define FXOS_XYZ_DATA_CFG		0x0E
+#define FXOS_PULSE_CFG			0x21
+#define FXOS_PULSE_SRC			0x22
+#define FXOS_PULSE_THSX			0x23
+#define FXOS_PULSE_TMLT			0x26
+#define FXOS_PULSE_LTCY			0x27
+#define FXOS_CTRL_REG1			0x2A
+#define FXOS_CTRL_REG4			0x2D
+#define FXOS_CTRL_REG5			0x2E
+#define FXOS_M_OUT_X_MSB		0x33
+#define FXOS_M_CTRL_REG1		0x5B
+#define FXOS_M_CTRL_REG2		0x5C
+
+#define FXOS_SRC_FIFO			0x40
+#define FXOS_SRC_PULSE			0x08
+#define FXOS_F_CNT_MASK			0x3F
+
+// motionPoll() steps, each one ChariotI2C transaction
+#define MOTION_STEP_SRC			0
+#define MOTION_STEP_PULSE		1
+#define MOTION_STEP_STATUS		2
+#define MOTION_STEP_BURST		3
+
+bool ChariotEPClass::fxosWrite(uint8_t reg, uint8_t val)
+{
+  const uint8_t wbuf[2] = { reg, val };
+  return (ChariotI2C.transfer(FXOS8700_ADDRESS, wbuf, 2, NULL, 0) == I2C_OK);
+}
+
+uint8_t ChariotEPClass::fxosRead(uint8_t reg, uint8_t *buf, uint8_t len)
+{
+  return (ChariotI2C.transfer(FXOS8700_ADDRESS, &reg, 1, buf, len) == I2C_OK) ? len : 0;
+}
+
+/*
+ * Start the sensor in hybrid (accel+mag) mode at the given MOTION_ODR_* rate,
+ * with the accel FIFO in circular mode and its watermark (1..31) and single
+ * tap detection routed to INT1. Pass the Arduino pin INT1 is jumpered to, or
+ * -1 to have motionPoll() ask the sensor over I2C instead.
+ */
+bool ChariotEPClass::motionBegin(uint8_t odr, uint8_t watermark, int intPin)
+{
+  uint8_t whoAmI = 0;
+  bool ok;
+
+  if ((odr > MOTION_ODR_25HZ) || (watermark == 0) || (watermark >= MOTION_FIFO_MAX))
+	return false;
+
+  fxosRead(FXOS_WHO_AM_I, &whoAmI, 1);
+  if (whoAmI != FXOS8700_WHO_AM_I_VAL) {
+	SerialMon.print(F("FXOS8700 not found, WHO_AM_I = 0x"));
+	SerialMon.println(whoAmI, HEX);
+	return false;
+  }
+
+  ok  = fxosWrite(FXOS_CTRL_REG1, 0x00);                // standby while configuring
+  ok &= fxosWrite(FXOS_F_SETUP, 0x40 | watermark);      // circular FIFO
+  ok &= fxosWrite(FXOS_XYZ_DATA_CFG, 0x00);             // +/-2g
+  ok &= fxosWrite(FXOS_M_CTRL_REG1, 0x1F);              // hybrid, max mag oversampling
+  ok &= fxosWrite(FXOS_M_CTRL_REG2, 0x00);              // no hybrid auto-increment into mag regs
+
+  // Single tap on any axis, latched. Thresholds/timing per NXP AN4072.
+  ok &= fxosWrite(FXOS_PULSE_CFG, 0x55);
+  ok &= fxosWrite(FXOS_PULSE_THSX, 0x19);
+  ok &= fxosWrite(FXOS_PULSE_THSX+1, 0x19);
+  ok &= fxosWrite(FXOS_PULSE_THSX+2, 0x2A);
+  ok &= fxosWrite(FXOS_PULSE_TMLT, 0x50);
+  ok &= fxosWrite(FXOS_PULSE_LTCY, 0xF0);
+
+  ok &= fxosWrite(FXOS_CTRL_REG4, FXOS_SRC_FIFO | FXOS_SRC_PULSE);  // enable interrupts
+  ok &= fxosWrite(FXOS_CTRL_REG5, FXOS_SRC_FIFO | FXOS_SRC_PULSE);  // route to INT1 (active LOW)
+  ok &= fxosWrite(FXOS_CTRL_REG1, (odr << 3) | 0x05);    // ODR, low noise, active
+
+  motionIntPin = intPin;
+  if (motionIntPin >= 0)
+	pinMode(motionIntPin, INPUT_PULLUP);
+  motionSamples = 0;
+  motionTaps = 0;
+  motionPeakSq = 0;
+  motionSum[0] = motionSum[1] = motionSum[2] = 0;
+  motionSumSq[0] = motionSumSq[1] = motionSumSq[2] = 0;
+  motionBusy = false;
+  motionDrained = 0;
+  motionDrops = 0;
+  motionLastPublish = millis();
+  return ok;
+}
+
+/*
+ * Publish motion features on an event resource every publishMillis:
+ *   {"n":samples,"rms":mg,"pk":mg,"tap":taps}
+ * (as a CBOR map if the resource was created with CBOR).
+ * rms is the vibration (gravity removed) over all axes, pk the largest
+ * total acceleration seen.
+ */
+int ChariotEPClass::setMotionResource(int handle, unsigned long publishMillis)
+{
+  if ((handle < 0) || (handle > (nextRsrcId-1)) || (publishMillis == 0)) {
+	return -1;
+  }
+  motionHandle = handle;
+  motionPublishMillis = publishMillis;
+  return 1;
+}
+
+// Every raw accel sample (in counts of MOTION_MG_PER_LSB) is handed to sampleCallback.
+void ChariotEPClass::setMotionCallback(void (*sampleCallback)(int16_t x, int16_t y, int16_t z))
+{
+  motionCallback = sampleCallback;
+}
+
+/*
+ * Call from loop(), along with ChariotI2C.poll(). When INT1 is asserted
+ * (or always, without an INT1 pin) queues the reads that collect taps and
+ * drain the FIFO; they run as ChariotI2C steps alongside other devices.
+ * Publishes features when due. Returns the samples drained since the last call.
+ * Without an INT1 pin there is always a read queued, so sleepUntilWork()
+ * returns WAKE_I2C at once and the loop never sleeps.
+ */
+int ChariotEPClass::motionPoll()
+{
+  int drained;
+
+  if (!motionBusy && !((motionIntPin >= 0) && (digitalRead(motionIntPin) == HIGH))) {
+	motionBusy = motionSubmit(MOTION_STEP_SRC, FXOS_INT_SOURCE, 1);
+  }
+
+  if ((motionHandle >= 0) && ((millis() - motionLastPublish) >= motionPublishMillis)) {
+	motionPublish();
+  }
+  drained = motionDrained;
+  motionDrained = 0;
+  return drained;
+}
+
+bool ChariotEPClass::motionSubmit(uint8_t step, uint8_t reg, uint8_t len)
+{
+  motionStep = step;
+  return (ChariotI2C.submit(FXOS8700_ADDRESS, &reg, 1, motionBuf, len, motionI2CDone, this) >= 0);
+}
+
+void ChariotEPClass::motionI2CDone(uint8_t status, uint8_t *data, uint8_t len, void *ctx)
+{
+  ChariotEPClass *ep = (ChariotEPClass *)ctx;
+
+  if (status != I2C_OK) {
+	ep->motionBusy = false;  // retried on the next motionPoll()
+	return;
+  }
+  ep->motionStepDone(data, len);
+}
+
+/*
+ * INT_SOURCE -> [PULSE_SRC] -> [F_STATUS -> burst...]. Each step queues the
+ * next; the chain ends, freeing motionPoll() to start another, when there is
+ * nothing left to read or the queue is full.
+ */
+void ChariotEPClass::motionStepDone(uint8_t *data, uint8_t len)
+{
+  uint8_t i, n;
+
+  switch (motionStep) {
+  case MOTION_STEP_SRC:
+	motionSrc = data[0];
+	if (motionSrc & FXOS_SRC_PULSE) {
+	  motionBusy = motionSubmit(MOTION_STEP_PULSE, FXOS_PULSE_SRC, 1);  // clears the latch
+	  return;
+	}
+	break;
+
+  case MOTION_STEP_PULSE:
+	if (data[0] & 0x80)
+	  motionTaps++;
+	break;
+
+  case MOTION_STEP_STATUS:
+	motionFifoLeft = data[0] & FXOS_F_CNT_MASK;
+	motionSrc = 0;
+	break;
+
+  case MOTION_STEP_BURST:
+	n = len / 6;
+	for (i = 0; i < n; i++) {
+	  int16_t x = (int16_t)word(data[i*6],   data[i*6+1]) >> 2;
+	  int16_t y = (int16_t)word(data[i*6+2], data[i*6+3]) >> 2;
+	  int16_t z = (int16_t)word(data[i*6+4], data[i*6+5]) >> 2;
+	  uint32_t magSq = (long)x*x + (long)y*y + (long)z*z;
+
+	  if (motionSamples < 0xFFFF) {
+		long d[3];
+		uint8_t a;
+
+		/*
+		 * Deviations from the window's first sample keep 1g of offset out
+		 * of the sums; squared they are summed exactly in 64 bits.
+		 */
+		if (motionSamples == 0) {
+		  motionRef[0] = x; motionRef[1] = y; motionRef[2] = z;
+		}
+		d[0] = x - motionRef[0]; d[1] = y - motionRef[1]; d[2] = z - motionRef[2];
+		for (a = 0; a < 3; a++) {
+		  motionSum[a] += d[a];
+		  motionSumSq[a] += (uint64_t)(d[a]*d[a]);
+		}
+		motionSamples++;
+	  }
+	  if (magSq > motionPeakSq)
+		motionPeakSq = magSq;
+	  if (motionCallback != NULL)
+		motionCallback(x, y, z);
+	}
+	motionFifoLeft -= n;
+	motionDrained += n;
+	break;
+  }
+
+  if (motionSrc & FXOS_SRC_FIFO) {
+	motionBusy = motionSubmit(MOTION_STEP_STATUS, FXOS_F_STATUS, 1);
+	return;
+  }
+  if ((motionStep >= MOTION_STEP_STATUS) && motionFifoLeft) {
+	// With the FIFO on, reads past OUT_Z_LSB wrap to OUT_X_MSB: one burst, many samples.
+	n = min(motionFifoLeft, (uint8_t)MOTION_BURST_SAMPLES);
+	motionBusy = motionSubmit(MOTION_STEP_BURST, FXOS_OUT_X_MSB, n*6);
+	return;
+  }
+  motionBusy = false;
+}
+
+void ChariotEPClass::motionPublish()
+{
+  float var = 0.0;
+  uint8_t i;
+  String ev;
+
+  if (motionSamples) {
+	for (i = 0; i < 3; i++) {
+	  float mean = (float)motionSum[i] / motionSamples;  // of the deviations
+	  var += (float)motionSumSq[i] / motionSamples - mean*mean;
+	}
+  }
+
+  int rms = (int)(sqrt(max(var, 0.0)) * MOTION_MG_PER_LSB);
+  int peak = (int)(sqrt((float)motionPeakSq) * MOTION_MG_PER_LSB);
+
+  bool sent;
+
+  if (rsrcFormats[motionHandle] == CBOR) {
+	uint8_t buf[32];  // worst case 25: n, rms and pk of 3 byte ints, tap of 2
+	ChariotCBOR cbor(buf, sizeof(buf));
+
+	cbor.beginMap(4);
+	cbor.addText(F("n"));   cbor.addInt(motionSamples);
+	cbor.addText(F("rms")); cbor.addInt(rms);
+	cbor.addText(F("pk"));  cbor.addInt(peak);
+	cbor.addText(F("tap")); cbor.addInt(motionTaps);
+	sent = triggerResourceEvent(motionHandle, cbor, true);
+  } else {
+	ev = "{\"n\":";
+	ev += motionSamples;
+	ev += ",\"rms\":";
+	ev += rms;
+	ev += ",\"pk\":";
+	ev += peak;
+	ev += ",\"tap\":";
+	ev += motionTaps;
+	ev += "}";
+	sent = triggerResourceEvent(motionHandle, ev, true);
+  }
+
+  motionLastPublish = millis();
+  if (!sent) {
+	// keep accumulating--the next publication covers this window too
+	if (motionDrops < 0xFFFF)
+	  motionDrops++;
+	SerialMon.println(F("motion: publication dropped"));
+	return;
+  }
+  motionSamples = 0;
+  motionTaps = 0;
+  motionPeakSq = 0;
+  for (i = 0; i < 3; i++) {
+	motionSum[i] = 0;
+	motionSumSq[i] = 0;
+  }
+}
+
+// Motion publications Chariot refused since motionBegin(); their windows were merged into the next.
+uint16_t ChariotEPClass::motionDropped() { return motionDrops; }
+
+// Magnetic field in 0.1uT counts, read directly (the FIFO holds accel data only).
+bool ChariotEPClass::motionReadMag(int16_t *x, int16_t *y, int16_t *z)
+{
+  uint8_t buf[6];
+  bool ok;
+
+  ok = (fxosRead(FXOS_M_OUT_X_MSB, buf, 6) == 6);
+  if (ok) {
+	*x = (int16_t)word(buf[0], buf[1]);
+	*y = (int16_t)word(buf[2], buf[3]);
+	*z = (int16_t)word(buf[4], buf[5]);
+  }
+  return ok;
+}
+
+/*-----------------------------------------------------------------------------------------------*/
+/* Shared I2C bus                                                                                */
+/*-----------------------------------------------------------------------------------------------*/
+ChariotI2CClass::ChariotI2CClass()
+{
+	head = 0;
+	count = 0;
+	started = false;
+}
+
+void ChariotI2CClass::begin()
+{
+	if (!started) {
+		Wire.begin();
+		started = true;
+	}
+}
+
+/*
+ * Queue a write of wlen bytes (register address first) followed, with a
+ * repeated start, by a read of rlen bytes into rbuf--either may be empty.
+ * wbuf is copied; rbuf must stay valid until done(status, rbuf, rlen, ctx)
+ * is called from poll(). With delayMillis it runs no sooner than that from
+ * now, and transactions queued after it may pass it--chain dependent steps
+ * from the callbacks. Returns the queue position, or -1 if it is full.
+ */
+int ChariotI2CClass::submit(uint8_t addr, const uint8_t *wbuf, uint8_t wlen, uint8_t *rbuf, uint8_t rlen, I2CCallback done, void *ctx, unsigned long delayMillis)
+{
+	Transaction *t;
+	
+	if ((count == I2C_QUEUE_LEN) || (wlen > I2C_MAX_WRITE) || (rlen > BUFFER_LENGTH) || ((rlen != 0) && (rbuf == NULL))) {
+		return -1;
+	}
+	
+	t = &queue[(head + count) % I2C_QUEUE_LEN];
+	t->addr = addr;
+	t->wlen = wlen;
+	if (wlen) {
+		memcpy(t->wbuf, wbuf, wlen);
+	}
+	t->rlen = rlen;
+	t->rbuf = rbuf;
+	t->done = done;
+	t->ctx = ctx;
+	t->due = millis() + delayMillis;
+	return count++;
+}
+
+/*
+ * Run the oldest queued transaction that is due, and its callback. The slot
+ * is freed first, so callbacks may queue follow-on transactions.
+ * Returns false if there was nothing to do.
+ */
+bool ChariotI2CClass::poll()
+{
+	Transaction t;
+	uint8_t status;
+	uint8_t i, j;
+	unsigned long now = millis();
+	
+	for (i = 0; i < count; i++) {
+		if ((long)(now - queue[(head + i) % I2C_QUEUE_LEN].due) >= 0) {
+			break;
+		}
+	}
+	if (i == count) {
+		return false;
+	}
+	t = queue[(head + i) % I2C_QUEUE_LEN];
+	for (j = i; j > 0; j--) {
+		// close the gap, keeping the waiting transactions in order
+		queue[(head + j) % I2C_QUEUE_LEN] = queue[(head + j - 1) % I2C_QUEUE_LEN];
+	}
+	head = (head + 1) % I2C_QUEUE_LEN;
+	count--;
+	
+	status = transfer(t.addr, t.wbuf, t.wlen, t.rbuf, t.rlen);
+	if (t.done != NULL) {
+		t.done(status, t.rbuf, t.rlen, t.ctx);
+	}
+	return true;
+}
+
+uint8_t ChariotI2CClass::pending() { return count; }
+
+// Some queued transaction is due to run now.
+bool ChariotI2CClass::ready()
+{
+	uint8_t i;
+	unsigned long now = millis();
+	
+	for (i = 0; i < count; i++) {
+		if ((long)(now - queue[(head + i) % I2C_QUEUE_LEN].due) >= 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Run one transaction now, bypassing the queue. For setup code and for
+ * the blocking readers kept for existing sketches.
+ */
+uint8_t ChariotI2CClass::transfer(uint8_t addr, const uint8_t *wbuf, uint8_t wlen, uint8_t *rbuf, uint8_t rlen)
+{
+	uint8_t status = I2C_OK;
+	uint8_t got = 0;
+	
+	begin();
+	if (wlen) {
+		Wire.beginTransmission(addr);
+		Wire.write(wbuf, wlen);
+		status = Wire.endTransmission(rlen == 0);  // keep the bus for a read
+		if (status != I2C_OK) {
+			return status;
+		}
+	}
+	if (rlen) {
+		Wire.requestFrom(addr, rlen);
+		while (Wire.available() && (got < rlen)) {
+			rbuf[got++] = Wire.read();
+		}
+		if (got < rlen) {
+			status = I2C_SHORT_READ;
+		}
+	}
+	return status;
+}
+
+/*-----------------------------------------------------------------------------------------------*/
+/* CBOR encoder                                                                                  */
+/*-----------------------------------------------------------------------------------------------*/
+#define CBOR_UINT				0
+#define CBOR_NEGINT				1
+#define CBOR_TEXT				3
+#define CBOR_ARRAY				4
+#define CBOR_MAP				5
+#define CBOR_SIMPLE				7
+
+ChariotCBOR::ChariotCBOR(uint8_t *buf, uint8_t size)
+{
+	this->buf = buf;
+	this->size = size;
+	reset();
+}
+
+void ChariotCBOR::reset()
+{
+	len = 0;
+	ovf = false;
+}
+
+bool ChariotCBOR::put(uint8_t b)
+{
+	if (len >= size) {
+		ovf = true;
+		return false;
+	}
+	buf[len++] = b;
+	return true;
+}
+
+// Major type and argument in the fewest bytes
+bool ChariotCBOR::head(uint8_t major, unsigned long val)
+{
+	major <<= 5;
+	if (val < 24) {
+		return put(major | val);
+	} else if (val <= 0xFF) {
+		return put(major | 24) && put(val);
+	} else if (val <= 0xFFFF) {
+		return put(major | 25) && put(val >> 8) && put(val);
+	}
+	return put(major | 26) && put(val >> 24) && put(val >> 16) && put(val >> 8) && put(val);
+}
+
+bool ChariotCBOR::beginMap(uint8_t pairs) { return head(CBOR_MAP, pairs); }
+bool ChariotCBOR::beginArray(uint8_t items) { return head(CBOR_ARRAY, items); }
+
+bool ChariotCBOR::addInt(long val)
+{
+	if (val < 0) {
+		return head(CBOR_NEGINT, (unsigned long)(-1 - val));
+	}
+	return head(CBOR_UINT, val);
+}
+
+bool ChariotCBOR::addFloat(float val)
+{
+	union { float f; uint32_t u; } bits;
+	
+	if ((fabs(val) < 2147483647.0) && (val == (long)val)) {
+		return addInt((long)val);
+	}
+	bits.f = val;
+	return put((CBOR_SIMPLE << 5) | 26) && put(bits.u >> 24) && put(bits.u >> 16) && put(bits.u >> 8) && put(bits.u);
+}
+
+bool ChariotCBOR::addText(const char *str)
+{
+	uint8_t n = strlen(str);
+	
+	if (!head(CBOR_TEXT, n)) {
+		return false;
+	}
+	while (n--) {
+		if (!put(*str++)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool ChariotCBOR::addText(const __FlashStringHelper *str)
+{
+	PGM_P p = reinterpret_cast<PGM_P>(str);
+	uint8_t n = strlen_P(p);
+	
+	if (!head(CBOR_TEXT, n)) {
+		return false;
+	}
+	while (n--) {
+		if (!put(pgm_read_byte(p++))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool ChariotCBOR::addBool(bool val) { return put((CBOR_SIMPLE << 5) | (val ? 21 : 20)); }
+bool ChariotCBOR::addNull() { return put((CBOR_SIMPLE << 5) | 22); }
+
+const uint8_t *ChariotCBOR::data() { return buf; }
+uint8_t ChariotCBOR::length() { return len; }
+bool ChariotCBOR::overflow() { return ovf; }
+
+/*-----------------------------------------------------------------------------------------------*/
+/* Response writer                                                                               */
+/*-----------------------------------------------------------------------------------------------*/
+ChariotWriter::ChariotWriter(Print& transport)
+{
+	out = &transport;
+	len = 0;
+}
+
+size_t ChariotWriter::write(uint8_t c)
+{
+	if (len == sizeof(buf)) {
+		send();  // longer than a frame buffer--stream it out in pieces
+	}
+	buf[len++] = c;
+	return 1;
+}
+
+// Hand what is buffered to the transport, e.g. after a PUT reply's '\n'.
+void ChariotWriter::flush()
+{
+	send();
+}
+
+// Terminate the frame for Chariot and hand it to the transport in one write.
+void ChariotWriter::endFrame()
+{
+	print(F("<\n"));
+	send();
+}
+
+void ChariotWriter::send()
+{
+	if (len) {
+		out->write(buf, len);
+		len = 0;
+	}
+}
+
+/*-----------------------------------------------------------------------------------------------*/
+/* Front end bridge                                                                              */
+/*-----------------------------------------------------------------------------------------------*/
+ChariotBridge::ChariotBridge(Stream& link)
+{
+	uint8_t i;
+	
+	this->link = &link;
+	len = 0;
+	held = false;
+	ltSeen = false;
+	reqLen = reqSent = 0;
+	txBuffered = false;  // learned in sendRequest()--the port may not be constructed yet
+	for (i = 0; i < BRIDGE_MAX_SUBSCRIBERS; i++) {
+		subs[i].send = NULL;
+	}
+}
+
+// Returns the subscriber's slot, or -1 when all are taken.
+int ChariotBridge::addSubscriber(BridgeSend send, void *ctx)
+{
+	int i;
+	
+	if (send == NULL) {
+		return -1;
+	}
+	for (i = 0; i < BRIDGE_MAX_SUBSCRIBERS; i++) {
+		if (subs[i].send == NULL) {
+			subs[i].send = send;
+			subs[i].ctx = ctx;
+			subs[i].cursor = held ? len : 0;  // joins with the next response
+			subs[i].stalls = 0;
+			return i;
+		}
+	}
+	return -1;
+}
+
+bool ChariotBridge::removeSubscriber(void *ctx)
+{
+	uint8_t i;
+	
+	for (i = 0; i < BRIDGE_MAX_SUBSCRIBERS; i++) {
+		if ((subs[i].send != NULL) && (subs[i].ctx == ctx)) {
+			subs[i].send = NULL;
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Queue a request for Chariot; poll() sends it as the link has room, so
+ * a long command never waits on a full transmit buffer. False if the last
+ * request is still going out or cmd won't fit in BRIDGE_REQ_LEN.
+ */
+bool ChariotBridge::request(const char *cmd, uint8_t cmdLen)
+{
+	if ((reqLen != 0) || (cmdLen + 1 > BRIDGE_REQ_LEN)) {
+		return false;
+	}
+	memcpy(req, cmd, cmdLen);
+	req[cmdLen] = '\n';
+	reqLen = cmdLen + 1;
+	reqSent = 0;
+	sendRequest();
+	return true;
+}
+
+bool ChariotBridge::request(String& cmd)
+{
+	return request(cmd.c_str(), min(cmd.length(), 0xFFU));
+}
+
+/*
+ * Write what the link has room for. A link with no transmit buffer
+ * (SoftwareSerial reports none) blocks on every byte anyway--it gets the
+ * whole request at once. Only a buffered port ever reports room, so the
+ * first time it does marks the link as buffered.
+ */
+bool ChariotBridge::sendRequest()
+{
+	int n = reqLen - reqSent;
+	int room;
+	
+	if (n == 0) {
+		return false;
+	}
+	room = link->availableForWrite();
+	if (room > 0) {
+		txBuffered = true;
+	}
+	if (txBuffered) {
+		n = min(n, room);
+	}
+	if (n <= 0) {
+		return false;
+	}
+	link->write(&req[reqSent], n);
+	reqSent += n;
+	if (reqSent == reqLen) {
+		reqLen = reqSent = 0;
+	}
+	return true;
+}
+
+/*
+ * Call from loop(). Sends what it can of a queued request and reads what
+ * the link has ready, then offers each subscriber its next chunk of the
+ * held response. Returns true if anything moved.
+ */
+bool ChariotBridge::poll()
+{
+	bool moved = sendRequest();
+	
+	if (!held) {
+		moved |= readLink();
+	}
+	if (held) {
+		moved |= fanOut();
+	}
+	return moved;
+}
+
+// A request is going out, or a response is being read or fanned out.
+bool ChariotBridge::busy() { return (reqLen != 0) || held || (len != 0) || ltSeen; }
+
+/*
+ * Read without waiting until "<<" ends the response. A response longer than
+ * the buffer is fanned out in buffer-sized pieces.
+ */
+bool ChariotBridge::readLink()
+{
+	bool moved = false;
+	int c;
+	
+	while (!held && (link->available() > 0)) {
+		c = link->read();
+		moved = true;
+		if (c == '<') {
+			if (ltSeen) {
+				ltSeen = false;
+				held = (len != 0);
+			} else {
+				ltSeen = true;
+			}
+			continue;
+		}
+		if (ltSeen) {
+			buf[len++] = '<';  // a lone '<' is data
+			ltSeen = false;
+		}
+		buf[len++] = (uint8_t)c;
+		if (len >= BRIDGE_BUF_LEN - 1) {
+			held = true;  // keeps room for a '<' and its follower
+		}
+	}
+	return moved;
+}
+
+bool ChariotBridge::fanOut()
+{
+	bool moved = false, pending = false;
+	uint8_t i, n;
+	
+	for (i = 0; i < BRIDGE_MAX_SUBSCRIBERS; i++) {
+		Subscriber *sub = &subs[i];
+		
+		if ((sub->send == NULL) || (sub->cursor >= len)) {
+			continue;
+		}
+		n = min(len - sub->cursor, BRIDGE_CHUNK_LEN);
+		if ((n = sub->send(sub->ctx, &buf[sub->cursor], n)) != 0) {
+			sub->cursor += n;
+			sub->stalls = 0;
+			moved = true;
+		} else if (++sub->stalls >= BRIDGE_MAX_STALLS) {
+			sub->send = NULL;  // gone or stuck--don't let it hold the link
+			continue;
+		}
+		if (sub->cursor < len) {
+			pending = true;
+		}
+	}
+	
+	if (!pending) {
+		for (i = 0; i < BRIDGE_MAX_SUBSCRIBERS; i++) {
+			subs[i].cursor = 0;
+		}
+		len = 0;
+		held = false;
+		moved = true;
+	}
+	return moved;
+}
+
+#if CHARIOT_TRACE
+/*-----------------------------------------------------------------------------------------------*/
+/* Link trace recorder                                                                           */
+/*-----------------------------------------------------------------------------------------------*/
+#define TRACE_HDR_LEN			6
+
+ChariotTraceClass::ChariotTraceClass()
+{
+	clear();
+}
+
+void ChariotTraceClass::clear()
+{
+	head = tail = used = 0;
+	openAt = -1;
+}
+
+uint8_t ChariotTraceClass::at(uint16_t i) { return ring[i % TRACE_BUF_LEN]; }
+
+void ChariotTraceClass::dropOldest()
+{
+	uint16_t n = TRACE_HDR_LEN + at(tail + 1);
+	
+	if ((int16_t)tail == openAt) {
+		openAt = -1;  // the open entry itself is going--start afresh
+	}
+	tail = (tail + n) % TRACE_BUF_LEN;
+	used -= n;
+}
+
+void ChariotTraceClass::put(uint8_t b)
+{
+	ring[head] = b;
+	head = (head + 1) % TRACE_BUF_LEN;
+	used++;
+}
+
+// Start an entry stamped now; any open entry is closed first.
+void ChariotTraceClass::open(uint8_t dirLink)
+{
+	unsigned long now = micros();
+	uint8_t i;
+	
+	close();
+	while (used > (TRACE_BUF_LEN - TRACE_HDR_LEN)) {
+		dropOldest();
+	}
+	openAt = head;
+	openDirLink = dirLink;
+	put(dirLink);
+	put(0);
+	for (i = 0; i < 4; i++) {
+		put(now >> (8*i));
+	}
+}
+
+/*
+ * Add a byte to the open entry, opening one if the direction or link
+ * changed. Entries end at '\n' and '\0', Chariot's frame terminators.
+ */
+void ChariotTraceClass::record(uint8_t dirLink, uint8_t c)
+{
+	uint16_t lenAt;
+	
+	touch(dirLink);
+	lenAt = (openAt + 1) % TRACE_BUF_LEN;
+	if (ring[lenAt] == TRACE_MAX_ENTRY) {
+		open(dirLink);
+		lenAt = (openAt + 1) % TRACE_BUF_LEN;
+	}
+	while (used == TRACE_BUF_LEN) {
+		dropOldest();
+		if (openAt < 0) {  // it was ours
+			record(dirLink, c);
+			return;
+		}
+	}
+	put(c);
+	ring[lenAt]++;
+	if ((c == '\n') || (c == '\0')) {
+		close();
+	}
+}
+
+// Open an entry for dirLink unless one is already being filled.
+void ChariotTraceClass::touch(uint8_t dirLink)
+{
+	if ((openAt < 0) || (openDirLink != dirLink)) {
+		open(dirLink);
+	}
+}
+
+void ChariotTraceClass::close()
+{
+	openAt = -1;
+}
+
+/*
+ * One line per entry: T <micros> <link> <R|T> <hex bytes>
+ */
+void ChariotTraceClass::dump(Print& out)
+{
+	uint16_t i = tail, left = used;
+	uint8_t dirLink, len, b;
+	unsigned long ts;
+	
+	out.println(F("# chariot trace v1"));
+	while (left >= TRACE_HDR_LEN) {
+		dirLink = at(i);
+		len = at(i + 1);
+		ts = 0;
+		for (b = 0; b < 4; b++) {
+			ts |= (unsigned long)at(i + 2 + b) << (8*b);
+		}
+		out.print(F("T "));
+		out.print(ts);
+		out.print(' ');
+		out.print(dirLink & TRACE_LINK_MASK);
+		out.print((dirLink & TRACE_TX) ? F(" T ") : F(" R "));
+		for (b = 0; b < len; b++) {
+			uint8_t c = at(i + TRACE_HDR_LEN + b);
+			out.print((char)("0123456789abcdef"[c >> 4]));
+			out.print((char)("0123456789abcdef"[c & 0x0F]));
+		}
+		out.println();
+		i += TRACE_HDR_LEN + len;
+		left -= TRACE_HDR_LEN + len;
+	}
+	out.println(F("# end"));
+}
+
+void ChariotTraceStream::attach(Stream& transport)
+{
+	inner = &transport;
+	link = TRACE_LINK_UNSET;
+}
+
+void ChariotTraceStream::setLink(uint8_t link) { this->link = link & TRACE_LINK_MASK; }
+uint8_t ChariotTraceStream::getLink() { return link; }
+
+// The RX entry is stamped when input is first seen, not when it is read.
+int ChariotTraceStream::available()
+{
+	int n = inner->available();
+	
+	if (n) {
+		ChariotTrace.touch(TRACE_RX | link);
+	}
+	return n;
+}
+
+int ChariotTraceStream::read()
+{
+	int c = inner->read();
+	
+	if (c >= 0) {
+		ChariotTrace.record(TRACE_RX | link, c);
+	}
+	return c;
+}
+
+int ChariotTraceStream::peek() { return inner->peek(); }
+int ChariotTraceStream::availableForWrite() { return inner->availableForWrite(); }
+
+size_t ChariotTraceStream::write(uint8_t c)
+{
+	ChariotTrace.record(TRACE_TX | link, c);
+	return inner->write(c);
+}
+
+size_t ChariotTraceStream::write(const uint8_t *buf, size_t size)
+{
+	size_t i;
+	
+	for (i = 0; i < size; i++) {
+		ChariotTrace.record(TRACE_TX | link, buf[i]);
+	}
+	return inner->write(buf, size);
+}
+
+ChariotTraceClass ChariotTrace;
+#endif
+
+ChariotI2CClass ChariotI2C; // the shared I2C bus
+ChariotEPClass ChariotEP; // Create an object
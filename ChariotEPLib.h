@@ -12,6 +12,9 @@
 #include <SoftwareSerial.h>
 
 #define EP_DEBUG			0
+#ifndef CHARIOT_TRACE
+#define CHARIOT_TRACE		0	// 1: record link traffic for "trace" dumps
+#endif
 #define SerialMon			if(debug)Serial
 
 #define UNO					1
@@ -29,6 +32,11 @@
 	#define RX_PIN			11
 	#define TX_PIN			12//4 -- problem using pin 4?
 	#define MAX_RESOURCES	6
+	#define RSRC_RAM_BUDGET	128		// bytes of static RAM for the resource table
+	#define CHARIOT_RAM_BUDGET	640	// ...and for all of the library's static state
+	#define I2C_QUEUE_LEN	4		// pending ChariotI2C transactions
+	#define MAX_SUBSCRIPTIONS	2	// remote resources observed via subscribe()
+	#define BRIDGE_BUF_LEN		128	// one Chariot response held by a ChariotBridge
 
 #elif defined(HAVE_HWSERIAL0) && !defined(HAVE_HWSERIAL1)
     //# UNO Host
@@ -38,6 +46,11 @@
 	#define RX_PIN			11
 	#define TX_PIN			12
 	#define MAX_RESOURCES	4
+	#define RSRC_RAM_BUDGET	96
+	#define CHARIOT_RAM_BUDGET	512
+	#define I2C_QUEUE_LEN	4
+	#define MAX_SUBSCRIPTIONS	2
+	#define BRIDGE_BUF_LEN		128
 	
 #elif defined(HAVE_HWSERIAL3)
 	// MEGA Host
@@ -45,6 +58,11 @@
     #define UNO_HOST    	0
     #define MEGA_DUE_HOST 	1
 	#define MAX_RESOURCES	8	// the limit of Chariot 
+	#define RSRC_RAM_BUDGET	256
+	#define CHARIOT_RAM_BUDGET	2048
+	#define I2C_QUEUE_LEN	8
+	#define MAX_SUBSCRIPTIONS	4
+	#define BRIDGE_BUF_LEN		256
     #define ChariotClient Serial3
 #else
   #error Board type not supported by Chariot at this time--contact Qualia Networks Tech Support.
@@ -56,14 +74,43 @@
  */
 #define RSRC_EVENT_INT_PIN  	9  // initiate external event interrupt
 #define CHARIOT_STATE_PIN   	8  // driven HIGH when Chariot is online
-#define MAX_BUFLEN				64
+// (defaults for ChariotEP--further links pass their own pins)
+#ifndef MAX_BUFLEN
+#define MAX_BUFLEN				64  // longest frame on the link; may be lowered to save RAM
+#endif
+
+#define CHARIOT_MAX_RSRCS		8  // resources Chariot can hold for us
+#define CHARIOT_LINE_MAX		128  // longest line Chariot's serial reader accepts
+#define CHARIOT_REPLY_MILLIS	5000 // longest wait for Chariot to start a reply
+
+#define HISTORY_EXP				-2    // default history scale: values kept x100 in an int16
+#define HISTORY_NONE			0xFF  // resource has no history ring
 
 #define	TMP275_ADDRESS			0x48
+#define TMP275_CONV_MILLIS		250  // 12 bit one-shot conversion (220ms typical)
+/*
+ * FXOS8700CQ 6-axis accelerometer/magnetometer on Chariot's I2C bus
+ */
+#define FXOS8700_ADDRESS		0x1E
+#define FXOS8700_WHO_AM_I_VAL	0xC7
+
+// Hybrid (accel+mag) output data rates for motionBegin()
+#define MOTION_ODR_400HZ		0
+#define MOTION_ODR_200HZ		1
+#define MOTION_ODR_100HZ		2
+#define MOTION_ODR_50HZ			3
+#define MOTION_ODR_25HZ			4
+
+#define MOTION_FIFO_MAX			32  // FXOS8700 FIFO depth (accel samples)
+#define MOTION_MG_PER_LSB		0.244  // +/-2g range, 14 bit
+#define MOTION_BURST_SAMPLES	(BUFFER_LENGTH/6)  // Wire's buffer bounds one burst
+
 #define FAHRENHEIT    			1
 #define CELSIUS       			2
 #define KELVIN        			3
 
 #define JSON          			50  // per CoAP RFC
+#define CBOR          			60  // per CoAP RFC 7049
 
 #define LT            			1
 #define GT            			2
@@ -78,36 +125,306 @@
 #define MINUTES       			1
 #define SECONDS       			2
 
+/*
+ * sleepUntilWork() wake reasons
+ */
+#define WAKE_TIMEOUT			0  // maxSleepMillis expired
+#define WAKE_CHARIOT			1  // Chariot sent us something
+#define WAKE_STATE_PIN			2  // Chariot went online or offline
+#define WAKE_SERIAL_MON			3  // Serial monitor input (debug only)
+#define WAKE_I2C				4  // ChariotI2C has transactions due to run
+#define WAKE_MOTION				5  // FXOS8700 INT1 asserted--call motionPoll()
+
+/*
+ * ChariotI2C transaction status--0..4 are Wire.endTransmission()'s codes
+ */
+#define I2C_OK					0
+#define I2C_NACK_ADDR			2
+#define I2C_NACK_DATA			3
+#define I2C_ERROR				4
+#define I2C_SHORT_READ			5
+#define I2C_MAX_WRITE			4  // bytes written per transaction (register + data)
+
+/*
+ * Compact CBOR (RFC 7049) encoder for event resources created with the
+ * CBOR content format. Writes into a caller-supplied buffer; integral
+ * floats are sent as the shortest integer. Check overflow() before use.
+ */
+class ChariotCBOR
+{
+  public:
+	ChariotCBOR(uint8_t *buf, uint8_t size);
+	void reset();
+	bool beginMap(uint8_t pairs);
+	bool beginArray(uint8_t items);
+	bool addInt(long val);
+	bool addFloat(float val);
+	bool addText(const char *str);
+	bool addText(const __FlashStringHelper *str);
+	bool addBool(bool val);
+	bool addNull();
+	const uint8_t *data();
+	uint8_t length();
+	bool overflow();
+
+  private:
+	uint8_t *buf;
+	uint8_t size;
+	uint8_t len;
+	bool ovf;
+	bool put(uint8_t b);
+	bool head(uint8_t major, unsigned long val);
+};
+
+/*
+ * Builds a reply for Chariot without heap Strings: print() F() fragments and
+ * numbers into it, then endFrame() adds the "<\n" terminator and writes the
+ * frame to the transport at once.
+ */
+class ChariotWriter : public Print
+{
+  public:
+	ChariotWriter(Print& transport);
+	virtual size_t write(uint8_t c);
+	using Print::write;
+	virtual void flush();
+	void endFrame();
+
+  private:
+	Print *out;
+	uint8_t buf[MAX_BUFLEN];
+	uint8_t len;
+	void send();
+};
+
+/*
+ * ChariotBridge subscribers--e.g. WebSocket clients
+ */
+#define BRIDGE_MAX_SUBSCRIBERS	4
+#define BRIDGE_CHUNK_LEN		125  // largest WebSocket frame with a one byte length
+#define BRIDGE_MAX_STALLS		50   // refused sends in a row before a subscriber is dropped
+#define BRIDGE_REQ_LEN			CHARIOT_LINE_MAX  // longest request, its '\n' included
+
+/*
+ * Offer len bytes to a subscriber; returns how many it took, 0 if it cannot
+ * take any now. Must not block--a full subscriber takes what fits and is
+ * offered the rest on the next poll(). Chunks are pieces of a response, not
+ * lines: add no line endings of your own.
+ */
+typedef uint8_t (*BridgeSend)(void *ctx, const uint8_t *data, uint8_t len);
+
+/*
+ * Moves requests from any number of front ends (WebSocket clients, say) to
+ * a Chariot link and fans the responses back out, without blocking. A
+ * response is read into one buffer as it arrives; each subscriber takes
+ * it from its own cursor, a chunk per poll(). The next response is not read
+ * until every subscriber has taken the last, so a slow client holds the
+ * link back instead of being overrun. Requests go out the same way, as the
+ * link has write space for them.
+ */
+class ChariotBridge
+{
+  public:
+	ChariotBridge(Stream& link);
+	int addSubscriber(BridgeSend send, void *ctx);
+	bool removeSubscriber(void *ctx);
+	bool request(const char *cmd, uint8_t len);
+	bool request(String& cmd);
+	bool poll();
+	bool busy();
+
+  private:
+	struct Subscriber {
+		BridgeSend send;
+		void *ctx;
+		uint16_t cursor;	// bytes of the held response it has taken
+		uint8_t stalls;
+	};
+	Stream *link;
+	Subscriber subs[BRIDGE_MAX_SUBSCRIBERS];
+	uint8_t buf[BRIDGE_BUF_LEN];
+	uint16_t len;
+	bool held;			// buf holds a response (or a buffer-full piece) to fan out
+	bool ltSeen;		// last byte read was the first '<' of "<<"
+	uint8_t req[BRIDGE_REQ_LEN];
+	uint8_t reqLen;
+	uint8_t reqSent;
+	bool txBuffered;	// the link has reported write space (HardwareSerial)
+	bool fanOut();
+	bool readLink();
+	bool sendRequest();
+};
+
+#if CHARIOT_TRACE
+/*
+ * Link trace recorder. Frames crossing every Chariot link are kept with
+ * micros() timestamps in a RAM ring, oldest dropped first, and dumped by the
+ * "trace" serial command for extras/trace-replay. Each entry is a 6 byte
+ * header (direction|link, length, timestamp) followed by its bytes.
+ */
+#if UNO_HOST==1 || LEONARDO_HOST==1
+	#define TRACE_BUF_LEN		128
+#else
+	#define TRACE_BUF_LEN		512
+#endif
+#define TRACE_RX				0x00
+#define TRACE_TX				0x80
+#define TRACE_LINK_MASK			0x7F
+#define TRACE_LINK_UNSET		TRACE_LINK_MASK  // numbered by begin()
+#define TRACE_MAX_ENTRY			(TRACE_BUF_LEN/4 > 127 ? 127 : TRACE_BUF_LEN/4)
+
+class ChariotTraceClass
+{
+  public:
+	ChariotTraceClass();
+	void open(uint8_t dirLink);
+	void touch(uint8_t dirLink);
+	void record(uint8_t dirLink, uint8_t c);
+	void close();
+	void clear();
+	void dump(Print& out);
+
+  private:
+	uint8_t ring[TRACE_BUF_LEN];
+	uint16_t head;
+	uint16_t tail;
+	uint16_t used;
+	int16_t openAt;		// header of the entry being filled, or -1
+	uint8_t openDirLink;
+	uint8_t at(uint16_t i);
+	void put(uint8_t b);
+	void dropOldest();
+};
+
+// Stands between a link and its port, recording what crosses it.
+class ChariotTraceStream : public Stream
+{
+  public:
+	void attach(Stream& transport);
+	void setLink(uint8_t link);
+	uint8_t getLink();
+	virtual int available();
+	virtual int read();
+	virtual int peek();
+	virtual size_t write(uint8_t c);
+	virtual size_t write(const uint8_t *buf, size_t size);
+	virtual int availableForWrite();
+	using Print::write;
+
+  private:
+	Stream *inner;
+	uint8_t link;
+};
+
+extern ChariotTraceClass ChariotTrace;
+#endif
+
+typedef void (*I2CCallback)(uint8_t status, uint8_t *data, uint8_t len, void *ctx);
+
+/*
+ * Owner of the I2C bus shared by Chariot's sensors and the sketch's devices.
+ * Wire is started once and never torn down. Transactions are queued and run
+ * one per poll() call, in order, each ending in its completion callback, so
+ * no device holds the loop for more than one transfer.
+ */
+class ChariotI2CClass
+{
+  public:
+	ChariotI2CClass();
+	void begin();
+	int submit(uint8_t addr, const uint8_t *wbuf, uint8_t wlen, uint8_t *rbuf, uint8_t rlen, I2CCallback done, void *ctx, unsigned long delayMillis = 0);
+	bool poll();
+	uint8_t pending();
+	bool ready();
+	uint8_t transfer(uint8_t addr, const uint8_t *wbuf, uint8_t wlen, uint8_t *rbuf, uint8_t rlen);
+
+  private:
+	struct Transaction {
+		uint8_t addr;
+		uint8_t wlen;
+		uint8_t wbuf[I2C_MAX_WRITE];
+		uint8_t rlen;
+		uint8_t *rbuf;
+		I2CCallback done;
+		void *ctx;
+		unsigned long due;	// millis() before which it does not run
+	};
+	Transaction queue[I2C_QUEUE_LEN];
+	uint8_t head;
+	uint8_t count;
+	bool started;
+};
+
 class ChariotEPClass
 {
   public:
     ChariotEPClass();
+	ChariotEPClass(HardwareSerial& transport, uint8_t signalPin, uint8_t statePin);
+	ChariotEPClass(SoftwareSerial& transport, uint8_t signalPin, uint8_t statePin);
 	~ChariotEPClass();
     boolean begin();
 	int available();
+	Stream& getTransport();
 	void process();
+	uint8_t sleepUntilWork(unsigned long maxSleepMillis);
+	int freeRam();
+	int freeRamLowWater();
+	int freeRamResource(unsigned long publishMillis);
+	int rsrcFootprint(int handle);
 	int coapResponseGet(String& response);
 	bool pinValParse(String& command, int *pin, int *value);
 		
-	int createResource(String& uri, uint8_t maxBufLen, String& attrib);
-	int createResource(const __FlashStringHelper* uri, uint8_t maxBufLen, const __FlashStringHelper* attrib);
+	int createResource(String& uri, uint8_t maxBufLen, String& attrib, uint8_t contentFormat = JSON, uint8_t historyDepth = 0, int8_t historyExp = HISTORY_EXP);
+	int createResource(const __FlashStringHelper* uri, uint8_t maxBufLen, const __FlashStringHelper* attrib, uint8_t contentFormat = JSON, uint8_t historyDepth = 0, int8_t historyExp = HISTORY_EXP);
+	static bool setHistoryPool(uint32_t *pool, uint16_t bytes);
+	bool recordHistory(int handle, float value);
 	
 	bool triggerResourceEvent(int handle, String& event, bool signalChariot);
+	bool triggerResourceEvent(int handle, ChariotCBOR& event, bool signalChariot);
 	
 	void serialChariotCmd();
 	void serialChariotCmdHelp();
 	int getIdFromURI(String& uri);
 	int setPutHandler(int handle, String * (*putCallback)(String& putCmd));
+	int subscribe(String& remoteUri, void (*notifyCallback)(String& value));
+	int subscribe(const __FlashStringHelper* remoteUri, void (*notifyCallback)(String& value));
+	bool unsubscribe(int subHandle);
 	float readTMP275(uint8_t units);
+	bool requestTMP275(void (*tempCallback)(float celsius));
+	bool motionBegin(uint8_t odr, uint8_t watermark, int intPin);
+	int motionPoll();
+	int setMotionResource(int handle, unsigned long publishMillis);
+	void setMotionCallback(void (*sampleCallback)(int16_t x, int16_t y, int16_t z));
+	bool motionReadMag(int16_t *x, int16_t *y, int16_t *z);
+	uint16_t motionDropped();
 	uint8_t getArduinoModel();
 	void enableDebugMsgs();
 	void disableDebugMsgs();
 	
   private:
+	// This link to a Chariot, and the list of all links for sleepUntilWork()
+	Stream *client;
+	HardwareSerial *hwClient;
+	SoftwareSerial *swClient;
+	uint8_t signalPin;
+	uint8_t statePin;
+	ChariotEPClass *nextLink;
+	static ChariotEPClass *links;
+#if CHARIOT_TRACE
+	ChariotTraceStream traceStream;
+#endif
+
 	uint8_t arduinoType;
+	bool begun;				// begin() has run--unbegun links are not watched
 	bool chariotAvailable;
+	uint8_t chariotState;
 	uint8_t maxBufLen;
 	bool 	debug;
+	int		ramLowWater;
+	int		ramHandle;				// event/sys/freeram, or -1
+	int		ramPublishedLow;
+	unsigned long ramPublishMillis;
+	unsigned long ramLastPublish;
 
 	// Event resources--these are stored in Chariot
 	int nextRsrcId;
@@ -117,15 +434,118 @@ class ChariotEPClass
 	String * (*putCallbacks[MAX_RESOURCES])(String& putCmd);
 
 	uint8_t rsrcChariotBufSizes[MAX_RESOURCES];
+	uint8_t rsrcFormats[MAX_RESOURCES];
+
+	/*
+	 * History rings--a header and depth samples each, carved once from the
+	 * pool the sketch hands to setHistoryPool(), shared by all links. Samples
+	 * hold value x 10^-exp and the seconds since the sample before.
+	 */
+	struct HistoryRing {
+		uint32_t newest;	// millis() of the newest sample, less the sub-second remainder
+		uint8_t depth;
+		uint8_t head;		// next sample to write
+		uint8_t count;
+		int8_t exp;			// decimal exponent: value = val x 10^exp
+	};
+	struct HistorySample {
+		int16_t val;
+		uint16_t dt;
+	};
+	static uint32_t *historyPool;
+	static uint8_t historyPoolWords;		// pool size and use, in 4 byte words
+	static uint8_t historyPoolUsed;
+	uint8_t rsrcHistory[MAX_RESOURCES];		// word offset of the ring, or HISTORY_NONE
+
+	// Remote resources we observe through Chariot
+	void (*subCallbacks[MAX_SUBSCRIPTIONS])(String& value);
+
+	// FXOS8700 motion state--features accumulate between publications
+	int8_t motionIntPin;
+	int motionHandle;
+	unsigned long motionPublishMillis;
+	unsigned long motionLastPublish;
+	uint16_t motionDrops;		// publications Chariot did not take
+	void (*motionCallback)(int16_t x, int16_t y, int16_t z);
+	uint16_t motionSamples;
+	uint8_t motionTaps;
+	int16_t motionRef[3];		// first sample of the window--sums are of deviations from it
+	long motionSum[3];
+	uint64_t motionSumSq[3];	// exact, so the variance keeps its low bits
+	uint32_t motionPeakSq;
+	bool motionBusy;
+	uint8_t motionStep;
+	uint8_t motionSrc;
+	uint8_t motionFifoLeft;
+	int motionDrained;
+	uint8_t motionBuf[MOTION_BURST_SAMPLES*6];
+	void (*tmp275Callback)(float celsius);
+	uint8_t tmp275Buf[2];
 
 	void digitalCommand(String& command);
 	void analogCommand(String& command);
 	void modeCommand(String& command);
+	void linkInit(Stream& transport, uint8_t signalPin, uint8_t statePin);
+	static bool linkInputPending();
+	void sysCommand(String& command);
+	void notifyCommand(String& command);
+	void historyCommand(int handle, String& param);
+	HistoryRing *historyRing(int handle);
+	static bool historyFits(uint8_t depth);
+	void historyAlloc(int handle, uint8_t depth, int8_t exp);
+	int subscribeSend(String& remoteUri, void (*notifyCallback)(String& value));
+	bool chariotCreated();
+	String chariotReply();
+	bool chariotAwait();
+	void processCommand();
+	void sampleFreeRam();
+	void freeRamPublish();
+	void memReport();
+	bool fxosWrite(uint8_t reg, uint8_t val);
+	uint8_t fxosRead(uint8_t reg, uint8_t *buf, uint8_t len);
+	bool motionSubmit(uint8_t step, uint8_t reg, uint8_t len);
+	void motionStepDone(uint8_t *data, uint8_t len);
+	static void motionI2CDone(uint8_t status, uint8_t *data, uint8_t len, void *ctx);
+	static void tmp275I2CStarted(uint8_t status, uint8_t *data, uint8_t len, void *ctx);
+	static void tmp275I2CDone(uint8_t status, uint8_t *data, uint8_t len, void *ctx);
+	void motionPublish();
+	bool rsrcEventSend(int handle, String& ev, unsigned int evLen, bool signalChariot);
 	void chariotSignal(int pin);
 	void chariotPrintResponse();
 };
 
+/*
+ * Static RAM taken by one resource slot: URI and attribute Strings (their
+ * text lives on the heap--see rsrcFootprint()), PUT callback, Chariot buffer
+ * size, content format and history ring offset.
+ */
+#define RSRC_SLOT_BYTES		(2*sizeof(String) + sizeof(void *) + 3*sizeof(uint8_t))
+#define HISTORY_WORDS(depth)	(2 + (depth))  // ring header + one word per sample
+
+static_assert(MAX_RESOURCES <= CHARIOT_MAX_RSRCS, "MAX_RESOURCES exceeds what Chariot can hold");
+static_assert(MAX_BUFLEN <= 64, "MAX_BUFLEN exceeds Chariot's resource buffer");
+#ifdef __AVR__
+static_assert(MAX_RESOURCES*RSRC_SLOT_BYTES <= RSRC_RAM_BUDGET, "resource table exceeds RSRC_RAM_BUDGET for this board");
+#endif
+
+/*
+ * All static RAM the library takes with one link: the link (resource table,
+ * subscriptions, motion state and buffers), the I2C queue and, when compiled
+ * in, the trace ring. Each further link adds sizeof(ChariotEPClass); a history
+ * pool is the sketch's own.
+ */
+#if CHARIOT_TRACE
+	#define CHARIOT_TRACE_BYTES	sizeof(ChariotTraceClass)
+#else
+	#define CHARIOT_TRACE_BYTES	0
+#endif
+#define CHARIOT_STATIC_BYTES	(sizeof(ChariotEPClass) + sizeof(ChariotI2CClass) + CHARIOT_TRACE_BYTES)
+#ifdef __AVR__
+static_assert(CHARIOT_STATIC_BYTES <= CHARIOT_RAM_BUDGET, "library static RAM exceeds CHARIOT_RAM_BUDGET for this board");
+#endif
+
 extern ChariotEPClass ChariotEP;   // the EndPoint object for Chariot
+extern ChariotI2CClass ChariotI2C; // the shared I2C bus
 #if LEONARDO_HOST==1 || UNO_HOST==1
     extern SoftwareSerial ChariotClient;
 #endif
@@ -9,9 +9,9 @@
   backend.
    
   It passes arriving Arduino and Chariot(CoAP) commands from a websocket frontend 
-  through the service backend across Arduino's serial port to Chariot. Any 
-  response strings from Chariot or command input from the Serial Monitor are conveyed to the backend for
-  processing. Some modifications have been made to "Websocket-Arduino, a simple websocket implementation
+  through the service backend across Arduino's serial port to Chariot. A ChariotBridge
+  fans Chariot's responses out to every open websocket (and the Serial Monitor when
+  debugging) without blocking the loop. Some modifications have been made to "Websocket-Arduino, a simple websocket implementation
   for Arduino" (see its source code for copyright notices):
     1.) Frames are limited to 125B. Data sent to websocket will be so-segmented.
     2.) In the WebsocketServer constructor, the port number used is 1337. This is also used by default in 
@@ -35,10 +35,7 @@
 static bool debug = false;
 
 #define MAX_CHARIOT_CMD_LEN   (128-1)
-#define MAX_CHARIOT_IO_MILLIS (500)
-#define MAX_CONCURRENT_CHARIOT_MSGS (4)
 
-void coapResponse(WebSocket &socket);
 // Enable websocket debug tracing to Serial port. See Websocket.h.
 #define DEBUG
 
@@ -51,33 +48,51 @@ void coapResponse(WebSocket &socket);
 byte mac[] = { 0x52, 0x4F, 0x43, 0x4B, 0x45, 0x54 };
 byte ip[] = { 192, 168, 0 , 77 };
 
-// Create a Websocket server and sockets
+// Create a Websocket server, and the bridge that shares Chariot among its sockets
 WebSocketServer wsServer;
-#define MAX_WEB_SOCKETS (4) // See <websocket.h>
-WebSocket *openSockets[MAX_WEB_SOCKETS]  = {NULL};
+ChariotBridge bridge(ChariotClient);
 
-void onConnect(WebSocket &socket) {
-  WebSocket *ws_p = (WebSocket *)&socket;
+/*
+ * Bridge subscribers: each socket, and the Serial Monitor when debugging.
+ * A subscriber must not block--it takes what fits, 0 bytes if need be, and
+ * the bridge holds the rest of the response for it. WebSocket::send() can't tell us
+ * that: it copies into the W5100's 2KB socket buffer, which only fills when
+ * a client stops reading, and then waits for room. With a front end that
+ * reports its write space (EthernetClient::availableForWrite() in Ethernet 2),
+ * check it here and return 0 instead.
+ */
+uint8_t socketSend(void *ctx, const uint8_t *data, uint8_t len) {
+  WebSocket *socket = (WebSocket *)ctx;
 
-  int i;
-  for (i = 0; i < MAX_WEB_SOCKETS-1; i++) {
-    if (ws_p == openSockets[i]) {
-      SerialMon.println(F("ERROR! Websocket connection cannot be opened--no available slots."));
-      return; // we already have this one cached (ERR)
-    }
+  if (!socket->isConnected()) {
+    return 0;  // dropped after BRIDGE_MAX_STALLS, or by onDisconnect()
   }
+  return socket->send((char *)data, len) ? len : 0;  // one frame per chunk
+}
 
-  // Plug socket into first open slot in connection table.
-  for (i = 0; i < MAX_WEB_SOCKETS-1; i++) {
-    if (openSockets[i] == NULL) {
-      openSockets[i] = ws_p;
-      SerialMon.print(F("Websocket connection opened = "));
-      SerialMon.println(i);
-      return;
-    }
+// Chunks are pieces of a response--print them as they come, no line breaks.
+uint8_t serialSend(void *ctx, const uint8_t *data, uint8_t len) {
+  return Serial.write(data, min(len, Serial.availableForWrite()));
+}
+
+// Queue a request for Chariot; its response arrives through bridge.poll().
+void chariotRequest(WebSocket &socket, String& cmd) {
+  if (!bridge.request(cmd)) {
+    socket.send((char *)"Chariot busy--try again\n", sizeof("Chariot busy--try again\n")-1);
   }
 }
 
+void onConnect(WebSocket &socket) {
+  int slot = bridge.addSubscriber(socketSend, &socket);
+
+  if (slot == -1) {
+    SerialMon.println(F("ERROR! Websocket connection cannot be opened--no available slots."));
+    return;
+  }
+  SerialMon.print(F("Websocket connection opened = "));
+  SerialMon.println(slot);
+}
+
 /*   
 `* Called by the server when a data frame is received.
  */
@@ -92,7 +107,7 @@ void onData(WebSocket &socket, char* dataString, byte frameLength)
    * End of chariotUrlOrCmd line input reached--trim whitespace and nul terminate
    */
   chariotUrlOrCmd.trim();
-  SerialMon.print(F("chariot command to be sent to Chariot(len= "));
+  SerialMon.print(F("\nchariot command to be sent to Chariot(len= "));
   SerialMon.print(frameLength); //chariotUrlOrCmd.length());
   SerialMon.print(F("): "));
   SerialMon.println(chariotUrlOrCmd);
@@ -107,9 +122,7 @@ void onData(WebSocket &socket, char* dataString, byte frameLength)
   * process coap:// and coap:// URI's here
   */
   if (chariotUrlOrCmd.indexOf(F("coap")) != -1) {
-    chariotUrlOrCmd += "\n\0";    // terminate for Chariot
-    ChariotClient.print(chariotUrlOrCmd);
-    coapResponse(socket);
+    chariotRequest(socket, chariotUrlOrCmd);
   }
     
  /**
@@ -117,10 +130,7 @@ void onData(WebSocket &socket, char* dataString, byte frameLength)
   */
   else if (chariotUrlOrCmd.indexOf(F("chariot")) != -1) {
     chariotUrlOrCmd.remove(0, 8); // remove "chariot/"
-    chariotUrlOrCmd += "\n\0";    // terminate for Chariot
-
-    ChariotClient.print(chariotUrlOrCmd);
-    coapResponse(socket);
+    chariotRequest(socket, chariotUrlOrCmd);
   }
 
   /**
@@ -134,17 +144,8 @@ void onData(WebSocket &socket, char* dataString, byte frameLength)
 }
 
 void onDisconnect(WebSocket &socket) {
-  // Find and remove socket in connection table.
-  WebSocket *ws_p = &socket;
-
-  int i;
-  for (i = 0; i < MAX_WEB_SOCKETS-1; i++) {
-    if (openSockets[i] == ws_p) {
-      openSockets[i] = NULL;
-      SerialMon.print(F("Websocket connection closed = "));
-      SerialMon.println(i);
-      return;
-    }
+  if (bridge.removeSubscriber(&socket)) {
+    SerialMon.println(F("Websocket connection closed"));
   }
 }
 
@@ -165,6 +166,9 @@ void setup()
 
   //---Put Arduino resources on the air---
   ChariotEP.begin();
+  if (debug) {
+    bridge.addSubscriber(serialSend, NULL);
+  }
 
   //---Put Ethernet on the air (so to speak)---
   Ethernet.begin(mac, ip);
@@ -179,38 +183,12 @@ void setup()
 }
 
 void loop() {
-  int more, msgNdx;
-  String response[MAX_CONCURRENT_CHARIOT_MSGS];   
-  
   /*
-   * asynchronous response(s) arrived?
+   * Send queued requests as Serial3 has room, read Chariot's responses as
+   * they arrive and pass each, in 125B frames, to every socket. A slow
+   * socket holds back the next response.
    */
-   more = ChariotClient.available();
-   msgNdx = 0;
-   while (more && (msgNdx < MAX_CONCURRENT_CHARIOT_MSGS-1)) {
-      more = ChariotEP.coapResponseGet(response[msgNdx++]);
-   }
-
-  if (msgNdx) {
-    int x;
-    for (x = 0; x < msgNdx; x++)
-    {
-      if (wsServer.connectionCount() > 0) {
-        int i;
-        WebSocket *ws_p;
-        char *responseStr = (char *)response[x].c_str();
-        
-        for (i = 0; i < MAX_WEB_SOCKETS-1; i++) {
-          if (ws_p = openSockets[i]) {
-            ws_p->send(responseStr, response[x].length());
-          }
-        }
-      }
-      else {
-        SerialMon.println(response[x]);
-      }
-    }
-  }
+  bool moved = bridge.poll();
   
   /* 
    *  Filter your own inputs first--pass everthing else here.
@@ -222,7 +200,12 @@ void loop() {
   
   // Should be called for each loop.
   wsServer.listen();
-  delay(50);
+
+  // Ethernet has no wakeup line here--nap at most 50ms between listens,
+  // unless the bridge still has a response to hand out.
+  if (!moved) {
+    ChariotEP.sleepUntilWork(50);
+  }
 }
 
 
@@ -378,45 +361,3 @@ Serial.println(response);
     socket.send(response_ptr, response.length());
     return;
 }
-
-/*
- * Process Chariot local and coap[s]:// responses
- */
-void coapResponse(WebSocket &socket) 
-{
-  String response = "";
-  uint32_t started, len = 0;
-
-  started = millis();
-  ChariotEP.coapResponseGet(response);
-  
-  if (response.length() > 0) {
-    char *response_ptr = (char *)response.c_str();
-    String responseTime = String(millis()-started) + "(ms)\n";
-
-    if (response.length() > MAX_DATA_FRAME_LENGTH) {
-      int len = response.length();
-      int next = MAX_DATA_FRAME_LENGTH;
-       
-     while (next > 0) {
-        socket.send(response_ptr, next);
-        SerialMon.print(F("Sending "));
-        SerialMon.print(next);
-        SerialMon.print(F(" bytes at "));
-        SerialMon.print((int)response_ptr, HEX);
-        SerialMon.println();
-        len -= next;
-        response_ptr += next;
-        next = min(len, MAX_DATA_FRAME_LENGTH);
-        if (len > 0) {
-          delay(100);
-        }
-      }
-    } else {
-      socket.send(response_ptr, response.length());
-    }
-    
-    response_ptr = (char *)responseTime.c_str();
-    socket.send(response_ptr, responseTime.length());
-  }
-}
@@ -52,10 +52,12 @@ void loop() {
   }
 
 
-  //---type 'sys/help' for available
-  if (Serial.available()) {
+  //---type 'sys/help' for available (Serial port active only)---
+  if (debug && Serial.available()) {
     ChariotEP.serialChariotCmd();
   }
-  delay(50);
+
+  //---sleep until Chariot (or, when active, the Serial port) has something for us---
+  ChariotEP.sleepUntilWork(0);
 }
-
+
@@ -38,9 +38,11 @@ String triggerValStr = "{\"ID\":\"Trigger\",\"Triggered\":\"No\",\"State\":\"On\
 
 // Resource creation yields positive handle
 static int eventHandle = -1;
+static uint32_t historyStore[HISTORY_WORDS(12)];  // room for 12 temps
 
 String * triggerPutCallback(String& param); // RESTful PUTs on this URI come here.
 bool triggerCreate();
+void tempReady(float t);
 void sendPutResult(String& result);
 
 void inline resetTriggerTime() 
@@ -98,16 +100,22 @@ void loop() {
   }
 
   /* 
-   *  Examine trigger
+   *  Examine trigger--start a temperature read, tempReady() gets the result
    */
   if (triggerOk && (millis() > triggerChkTime)) {
     resetTriggerTime();
-    if (triggerCheck()) {
-      String triggeredVal = "{\"ID\":\"Trigger\",\"Triggered\":\"Yes\",\"State\":\"Off\"}";;
-      ChariotEP.triggerResourceEvent(eventHandle, triggeredVal, true); 
-    }
+    ChariotEP.requestTMP275(tempReady);
+  }
+  ChariotI2C.poll();  // the TMP275 converts while we sleep
+
+  /*
+   *  Sleep until Chariot needs us, the temperature is ready to read or
+   *  the next trigger check is due
+   */
+  long untilCheck = triggerOk ? (long)(triggerChkTime - millis()) : 0;
+  if (!triggerOk || (untilCheck > 0)) {
+    ChariotEP.sleepUntilWork(untilCheck);
   }
-  delay(50);
 }
 
 /*
@@ -120,7 +128,8 @@ bool triggerCreate()
   String attr = "title=\"Trigger\?get|obs|put\"";
   String eventVal = "{\"ID\":\"Trigger\",\"Triggered\":\"No\",\"State\":\"Off\"}";
   
-  if ((eventHandle = ChariotEP.createResource(trigger, 63, attr)) >= 0)  // create resource on Chariot
+  ChariotEP.setHistoryPool(historyStore, sizeof(historyStore));
+  if ((eventHandle = ChariotEP.createResource(trigger, 63, attr, JSON, 12)) >= 0)  // create resource on Chariot, keep 12 temps
   {
     if (ChariotEP.triggerResourceEvent(eventHandle, eventVal, true)){     // set its initial condition (JSON)
       ChariotEP.setPutHandler(eventHandle, triggerPutCallback);           // set RESTful PUT handler
@@ -136,17 +145,28 @@ bool triggerCreate()
 }
 
 /*
- * Trigger example using Chariot's I2C TMP275 temp sensor
+ * Each check's temperature, in Celsius, from ChariotI2C.poll()
  */
-bool triggerCheck()
+void tempReady(float t)
 {
-  float t;
+  // keep a trend for "history" PUTs, armed or not
+  ChariotEP.recordHistory(eventHandle, t);
   
+  if (triggerCheck(t)) {
+    String triggeredVal = "{\"ID\":\"Trigger\",\"Triggered\":\"Yes\",\"State\":\"Off\"}";;
+    ChariotEP.triggerResourceEvent(eventHandle, triggeredVal, true); 
+  }
+}
+
+/*
+ * Trigger example using Chariot's I2C TMP275 temp sensor
+ */
+bool triggerCheck(float t)
+{
   if (triggerState == OFF)
     return false;
     
   // trigger condition present?
-  t = ChariotEP.readTMP275(CELSIUS);
   if (((triggerFunc == GT) && (t > triggerVal))
       || ((triggerFunc == LT) && (t < triggerVal))) 
   {
@@ -289,4 +309,4 @@ void triggerFetch() {
   ChariotClient.print(statusJSON);
 }
 
-
+
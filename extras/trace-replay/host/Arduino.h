@@ -0,0 +1,217 @@
+/*
+ * Arduino.h - just enough of the Arduino core to build ChariotEPLib on a
+ *             Linux host for trace-replay. Looks like a MEGA (Serial3 is
+ *             the Chariot link); time is virtual, see host.cpp.
+ *
+ * Created for Qualia Networks, Inc.
+ * BSD license, all text above must be included in any redistribution.
+ */
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <type_traits>
+#include <stdio.h>
+#include <ctype.h>
+#include <math.h>
+#include <string>
+
+#define HAVE_HWSERIAL0
+#define HAVE_HWSERIAL1
+#define HAVE_HWSERIAL2
+#define HAVE_HWSERIAL3
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define HIGH				1
+#define LOW					0
+#define INPUT				0
+#define OUTPUT				1
+#define INPUT_PULLUP		2
+#define DEC					10
+#define HEX					16
+#define BIN					2
+#define B11100001			0xE1
+
+#define PROGMEM
+#define PGM_P				const char *
+#define strlen_P			strlen
+#define pgm_read_byte(p)	(*(const uint8_t *)(p))
+
+class __FlashStringHelper;
+#define F(s)				(reinterpret_cast<const __FlashStringHelper *>(s))
+
+template<class T, class U> inline typename std::common_type<T, U>::type min(T a, U b) { return (a < b) ? a : b; }
+template<class T, class U> inline typename std::common_type<T, U>::type max(T a, U b) { return (a > b) ? a : b; }
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+inline unsigned int word(uint8_t h, uint8_t l) { return ((unsigned int)h << 8) | l; }
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void yield();
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+int analogRead(uint8_t pin);
+void analogWrite(uint8_t pin, int val);
+inline void noInterrupts() {}
+inline void interrupts() {}
+
+class String
+{
+  public:
+	String(const char *s = "") : str(s ? s : "") {}
+	String(const __FlashStringHelper *s) : str((const char *)s) {}
+	String(const std::string &s) : str(s) {}
+	String(char c) : str(1, c) {}
+	String(int v, unsigned char base = 10) { fromLong(v, base); }
+	String(unsigned int v, unsigned char base = 10) { fromULong(v, base); }
+	String(long v, unsigned char base = 10) { fromLong(v, base); }
+	String(unsigned long v, unsigned char base = 10) { fromULong(v, base); }
+	String(unsigned char v, unsigned char base = 10) { fromULong(v, base); }
+	String(double v, unsigned char dp = 2) { char b[40]; snprintf(b, sizeof(b), "%.*f", dp, v); str = b; }
+
+	unsigned int length() const { return str.size(); }
+	const char *c_str() const { return str.c_str(); }
+	char charAt(unsigned int i) const { return (i < str.size()) ? str[i] : 0; }
+	char operator[](unsigned int i) const { return charAt(i); }
+	void setCharAt(unsigned int i, char c) { if (i < str.size()) str[i] = c; }
+
+	String &operator+=(const String &s) { str += s.str; return *this; }
+	String &operator+=(const char *s) { str += s; return *this; }
+	String &operator+=(const __FlashStringHelper *s) { str += (const char *)s; return *this; }
+	String &operator+=(char c) { str += c; return *this; }
+	String &operator+=(int v) { return *this += String(v); }
+	String &operator+=(unsigned int v) { return *this += String(v); }
+	String &operator+=(long v) { return *this += String(v); }
+	String &operator+=(unsigned long v) { return *this += String(v); }
+	String &operator+=(unsigned char v) { return *this += String(v); }
+	String &operator+=(double v) { return *this += String(v); }
+	friend String operator+(String a, const String &b) { a += b; return a; }
+	friend String operator+(String a, const char *b) { a += b; return a; }
+
+	// Like the AVR core, comparisons stop at an embedded nul.
+	bool operator==(const String &s) const { return strcmp(c_str(), s.c_str()) == 0; }
+	bool operator==(const char *s) const { return strcmp(c_str(), s ? s : "") == 0; }
+	bool operator!=(const String &s) const { return !(*this == s); }
+	bool operator!=(const char *s) const { return !(*this == s); }
+
+	int indexOf(char c, unsigned int from = 0) const { return found(str.find(c, from)); }
+	int indexOf(const String &s, unsigned int from = 0) const { return found(str.find(s.str, from)); }
+	int indexOf(const char *s, unsigned int from = 0) const { return indexOf(String(s), from); }
+	int indexOf(const __FlashStringHelper *s, unsigned int from = 0) const { return indexOf(String(s), from); }
+	bool startsWith(const String &s, unsigned int offset = 0) const {
+		return (offset + s.str.size() <= str.size()) && (str.compare(offset, s.str.size(), s.str) == 0);
+	}
+	String substring(unsigned int from) const { return (from < str.size()) ? String(str.substr(from)) : String(); }
+	String substring(unsigned int from, unsigned int to) const {
+		if (to > str.size()) to = str.size();
+		return (from < to) ? String(str.substr(from, to - from)) : String();
+	}
+	void remove(unsigned int i) { if (i < str.size()) str.erase(i); }
+	void remove(unsigned int i, unsigned int n) { if (i < str.size()) str.erase(i, n); }
+	void trim() {
+		size_t b = str.find_first_not_of(" \t\r\n\v\f");
+		size_t e = str.find_last_not_of(" \t\r\n\v\f");
+		str = (b == std::string::npos) ? "" : str.substr(b, e - b + 1);
+	}
+	void toLowerCase() { for (size_t i = 0; i < str.size(); i++) str[i] = tolower(str[i]); }
+	long toInt() const { return atol(str.c_str()); }
+	float toFloat() const { return atof(str.c_str()); }
+
+  private:
+	std::string str;
+	static int found(size_t pos) { return (pos == std::string::npos) ? -1 : (int)pos; }
+	void fromULong(unsigned long v, unsigned char base) {
+		char b[sizeof(long)*8 + 1];
+		int i = sizeof(b) - 1;
+		b[i] = '\0';
+		do { b[--i] = "0123456789abcdef"[v % base]; v /= base; } while (v);
+		str = b + i;
+	}
+	void fromLong(long v, unsigned char base) {
+		if ((base == 10) && (v < 0)) { fromULong(-(unsigned long)v, 10); str.insert(0, 1, '-'); }
+		else fromULong(v, base);
+	}
+};
+
+class Print
+{
+  public:
+	virtual ~Print() {}
+	virtual size_t write(uint8_t c) = 0;
+	virtual size_t write(const uint8_t *buf, size_t size) { size_t n = 0; while (size--) n += write(*buf++); return n; }
+	size_t write(const char *s) { return s ? write((const uint8_t *)s, strlen(s)) : 0; }
+	virtual void flush() {}
+	virtual int availableForWrite() { return 0; }
+
+	size_t print(const char *s) { return write(s); }
+	size_t print(const __FlashStringHelper *s) { return write((const char *)s); }
+	size_t print(const String &s) { return write((const uint8_t *)s.c_str(), s.length()); }
+	size_t print(char c) { return write((uint8_t)c); }
+	size_t print(unsigned char v, int base = DEC) { return print((unsigned long)v, base); }
+	size_t print(int v, int base = DEC) { return print((long)v, base); }
+	size_t print(unsigned int v, int base = DEC) { return print((unsigned long)v, base); }
+	size_t print(long v, int base = DEC) { return print(String(v, (unsigned char)base)); }
+	size_t print(unsigned long v, int base = DEC) { return print(String(v, (unsigned char)base)); }
+	size_t print(double v, int digits = 2) { return print(String(v, (unsigned char)digits)); }
+	size_t println() { return write("\r\n"); }
+	template<class T> size_t println(const T &v) { size_t n = print(v); return n + println(); }
+	template<class T> size_t println(const T &v, int f) { size_t n = print(v, f); return n + println(); }
+};
+
+class Stream : public Print
+{
+  public:
+	Stream() : timeout(1000) {}
+	virtual int available() = 0;
+	virtual int read() = 0;
+	virtual int peek() = 0;
+	void setTimeout(unsigned long ms) { timeout = ms; }
+	String readStringUntil(char terminator) {
+		String s;
+		int c;
+		while (((c = timedRead()) >= 0) && (c != terminator))
+			s += (char)c;
+		return s;
+	}
+
+  protected:
+	unsigned long timeout;
+	int timedRead() {
+		unsigned long start = millis();
+		do {
+			int c = read();
+			if (c >= 0)
+				return c;
+		} while (millis() - start < timeout);
+		return -1;
+	}
+};
+
+class HardwareSerial : public Stream
+{
+  public:
+	HardwareSerial(uint8_t port) : port(port) {}
+	void begin(unsigned long) {}
+	void end() {}
+	virtual int available();
+	virtual int read();
+	virtual int peek();
+	virtual size_t write(uint8_t c);
+	virtual int availableForWrite() { return 63; }  // an empty SERIAL_TX_BUFFER_SIZE buffer
+	using Print::write;
+	operator bool() { return true; }
+
+  private:
+	uint8_t port;
+};
+
+extern HardwareSerial Serial, Serial1, Serial2, Serial3;
+
+#endif
@@ -0,0 +1,21 @@
+/*
+ * SoftwareSerial.h - host stand-in, never connected.
+ */
+#ifndef HOST_SOFTWARESERIAL_H
+#define HOST_SOFTWARESERIAL_H
+
+#include <Arduino.h>
+
+class SoftwareSerial : public Stream
+{
+  public:
+	SoftwareSerial(uint8_t, uint8_t) {}
+	void begin(long) {}
+	virtual int available() { return 0; }
+	virtual int read() { return -1; }
+	virtual int peek() { return -1; }
+	virtual size_t write(uint8_t) { return 1; }
+	using Print::write;
+};
+
+#endif
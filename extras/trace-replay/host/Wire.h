@@ -0,0 +1,34 @@
+/*
+ * Wire.h - host stand-in: an I2C bus on which every device reads as zeros.
+ */
+#ifndef HOST_WIRE_H
+#define HOST_WIRE_H
+
+#include <Arduino.h>
+
+#define BUFFER_LENGTH		32
+
+class TwoWire : public Stream
+{
+  public:
+	TwoWire() : rxLeft(0) {}
+	void begin() {}
+	void end() {}
+	void beginTransmission(uint8_t) {}
+	uint8_t endTransmission(bool = true) { return 0; }
+	uint8_t requestFrom(uint8_t, uint8_t n) { rxLeft = n; return n; }
+	uint8_t requestFrom(int addr, int n) { return requestFrom((uint8_t)addr, (uint8_t)n); }
+	virtual size_t write(uint8_t) { return 1; }
+	size_t write(int c) { return write((uint8_t)c); }
+	using Print::write;
+	virtual int available() { return rxLeft; }
+	virtual int read() { if (!rxLeft) return -1; rxLeft--; return 0; }
+	virtual int peek() { return rxLeft ? 0 : -1; }
+
+  private:
+	int rxLeft;
+};
+
+extern TwoWire Wire;
+
+#endif
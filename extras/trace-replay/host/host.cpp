@@ -0,0 +1,170 @@
+/*
+ * host.cpp - Arduino core functions for the host build of ChariotEPLib.
+ */
+#include "host.h"
+#include <Wire.h>
+#include <deque>
+#include <time.h>
+
+HardwareSerial Serial(0), Serial1(1), Serial2(2), Serial3(3);
+TwoWire Wire;
+
+struct RxChunk {
+	uint32_t at;
+	std::string bytes;
+};
+
+static std::deque<RxChunk> rxQueue;
+static size_t rxPos;				// next byte of rxQueue.front()
+static uint32_t lastRxAt;		// when the chunk last read from became due
+static int idlePolls;				// consecutive empty available() calls
+static HostTxSink txSink;
+static void (*onDrained)();
+static bool monitor;
+
+static uint64_t clockOrigin;
+static uint64_t clockSkipped;
+static struct timespec realStart;
+
+/*-----------------------------------------------------------------------------------------------*/
+/* Virtual clock                                                                                 */
+/*-----------------------------------------------------------------------------------------------*/
+void hostClockStart(uint32_t at)
+{
+	clockOrigin = at;
+	clockSkipped = 0;
+	clock_gettime(CLOCK_MONOTONIC, &realStart);
+}
+
+// Running clock, kept in 64 bits so millis() does not jump when micros() wraps
+static uint64_t clockNow()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return clockOrigin + clockSkipped + (now.tv_sec - realStart.tv_sec) * 1000000ULL +
+		(now.tv_nsec - realStart.tv_nsec) / 1000;
+}
+
+unsigned long micros() { return (uint32_t)clockNow(); }
+unsigned long millis() { return (uint32_t)(clockNow() / 1000); }
+void delay(unsigned long ms) { clockSkipped += ms * 1000; }
+void delayMicroseconds(unsigned int us) { clockSkipped += us; }
+void yield() {}
+
+static void skipTo(uint32_t at)
+{
+	int32_t ahead = hostSince(at, micros());
+
+	if (ahead > 0) {
+		clockSkipped += ahead;
+	}
+}
+
+/*-----------------------------------------------------------------------------------------------*/
+/* Pins--Chariot is always online, I/O goes nowhere                                              */
+/*-----------------------------------------------------------------------------------------------*/
+void pinMode(uint8_t, uint8_t) {}
+void digitalWrite(uint8_t, uint8_t) {}
+int digitalRead(uint8_t) { return HIGH; }
+int analogRead(uint8_t) { return 0; }
+void analogWrite(uint8_t, int) {}
+
+/*-----------------------------------------------------------------------------------------------*/
+/* Replayed link                                                                                 */
+/*-----------------------------------------------------------------------------------------------*/
+void hostLinkQueue(uint32_t at, const std::string& bytes)
+{
+	RxChunk chunk;
+	std::deque<RxChunk>::iterator pos = rxQueue.end();
+
+	if (bytes.empty())
+		return;
+	chunk.at = at;
+	chunk.bytes = bytes;
+	while ((pos != rxQueue.begin()) && (hostSince((pos - 1)->at, at) > 0))
+		--pos;  // keep time order, equal times first come first served
+	rxQueue.insert(pos, chunk);
+}
+
+void hostLinkTxSink(HostTxSink sink) { txSink = sink; }
+void hostLinkOnDrained(void (*drained)()) { onDrained = drained; }
+void hostMonitor(bool on) { monitor = on; }
+
+// Nothing for the library to do until the next input: skip ahead to it.
+void hostLinkIdle()
+{
+	idlePolls = 0;
+	if (rxQueue.empty()) {
+		if (onDrained != NULL)
+			onDrained();
+		exit(0);
+	}
+	skipTo(rxQueue.front().at);
+}
+
+static int rxDueBytes()
+{
+	uint32_t now = micros();
+	size_t i;
+	int n = 0;
+
+	for (i = 0; (i < rxQueue.size()) && (hostSince(now, rxQueue[i].at) >= 0); i++) {
+		n += rxQueue[i].bytes.size() - ((i == 0) ? rxPos : 0);
+	}
+	return n;
+}
+
+int HardwareSerial::available()
+{
+	int n;
+
+	if (port != 3)
+		return 0;
+	n = rxDueBytes();
+	if (n) {
+		idlePolls = 0;
+	} else if (++idlePolls > 1) {
+		hostLinkIdle();  // the library is spinning on us
+		n = rxDueBytes();
+	}
+	return n;
+}
+
+int HardwareSerial::read()
+{
+	int c;
+
+	if ((port != 3) || rxQueue.empty())
+		return -1;
+	if (hostSince(micros(), rxQueue.front().at) < 0) {
+		skipTo(rxQueue.front().at);  // lets Stream timeouts expire in virtual time
+		return -1;
+	}
+	lastRxAt = rxQueue.front().at;
+	c = (uint8_t)rxQueue.front().bytes[rxPos++];
+	if (rxPos == rxQueue.front().bytes.size()) {
+		rxQueue.pop_front();
+		rxPos = 0;
+	}
+	idlePolls = 0;
+	return c;
+}
+
+int HardwareSerial::peek()
+{
+	if ((port != 3) || rxQueue.empty() || (hostSince(micros(), rxQueue.front().at) < 0))
+		return -1;
+	return (uint8_t)rxQueue.front().bytes[rxPos];
+}
+
+size_t HardwareSerial::write(uint8_t c)
+{
+	if (port == 3) {
+		if (txSink != NULL)
+			txSink(micros(), lastRxAt, c);
+	} else if ((port == 0) && monitor) {
+		fputc(c, stderr);
+	}
+	return 1;
+}
@@ -0,0 +1,28 @@
+/*
+ * host.h - virtual clock and the replayed Chariot link (Serial3).
+ *
+ * micros() is the trace's clock: it runs at host speed while the library
+ * computes, jumps ahead over delay(), and jumps to the next queued input
+ * when the library is only waiting for it.
+ */
+#ifndef HOST_H
+#define HOST_H
+
+#include <Arduino.h>
+#include <string>
+
+/*
+ * Times are 32 bit micros() stamps as on the mote; they wrap every ~71
+ * minutes, so compare them only through hostSince().
+ */
+typedef void (*HostTxSink)(uint32_t at, uint32_t cause, uint8_t c);
+
+inline int32_t hostSince(uint32_t now, uint32_t then) { return (int32_t)(now - then); }
+void hostClockStart(uint32_t at);
+void hostLinkQueue(uint32_t at, const std::string& bytes);
+void hostLinkTxSink(HostTxSink sink);
+void hostLinkOnDrained(void (*drained)());
+void hostLinkIdle();
+void hostMonitor(bool on);
+
+#endif
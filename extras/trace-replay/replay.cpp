@@ -0,0 +1,197 @@
+/*
+ * replay.cpp - replay a Chariot link trace against a host build of
+ *              ChariotEPClass and compare its replies, and their latency,
+ *              with what the mote sent in the field.
+ *
+ * usage: trace-replay [-v] [-l link] tracefile
+ *   tracefile  output of the "trace" serial command (CHARIOT_TRACE 1)
+ *   -l link    which Chariot link of the mote to replay (default 0)
+ *   -v         show the library's Serial monitor output on stderr
+ *
+ * Created for Qualia Networks, Inc.
+ * BSD license, all text above must be included in any redistribution.
+ */
+#include <ChariotEPLib.h>
+#include "host.h"
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+struct Frame {
+	uint32_t at;		// first byte sent
+	uint32_t cause;		// last input from Chariot before it, 0 if none
+	std::string bytes;
+};
+
+static std::vector<Frame> recorded, replayed;
+
+/*
+ * Split TX bytes into frames at '\n'. A frame is timed from its first byte
+ * and caused by the most recent RX before it.
+ */
+static void frameByte(std::vector<Frame>& frames, bool& open, uint32_t at, uint32_t cause, uint8_t c)
+{
+	if (!open) {
+		Frame f;
+		f.at = at;
+		f.cause = cause;
+		frames.push_back(f);
+		open = true;
+	}
+	frames.back().bytes += (char)c;
+	if (c == '\n')
+		open = false;
+}
+
+static bool replayOpen;
+
+static void onTx(uint32_t at, uint32_t cause, uint8_t c)
+{
+	frameByte(replayed, replayOpen, at, cause, c);
+}
+
+static std::string printable(const std::string& s)
+{
+	std::string out;
+	size_t i;
+
+	for (i = 0; (i < s.size()) && (out.size() < 40); i++) {
+		char c = s[i];
+		if (c == '\n')
+			out += "\\n";
+		else if (c == '\r')
+			out += "\\r";
+		else if (c == '\0')
+			out += "\\0";
+		else if (isprint((unsigned char)c))
+			out += c;
+		else
+			out += '.';
+	}
+	return out;
+}
+
+static long latency(const Frame& f)
+{
+	return f.cause ? (long)hostSince(f.at, f.cause) : -1;
+}
+
+static void report()
+{
+	size_t i, n = max(recorded.size(), replayed.size());
+	int mismatches = 0, timed = 0;
+	double recordedSum = 0.0, replayedSum = 0.0;
+
+	printf("%4s %14s %14s  %-5s %s\n", "#", "recorded(us)", "replayed(us)", "match", "frame");
+	for (i = 0; i < n; i++) {
+		const Frame *r = (i < recorded.size()) ? &recorded[i] : NULL;
+		const Frame *h = (i < replayed.size()) ? &replayed[i] : NULL;
+		bool match = r && h && (r->bytes == h->bytes);
+
+		if (!match)
+			mismatches++;
+		if (r && h && (latency(*r) >= 0) && (latency(*h) >= 0)) {
+			recordedSum += latency(*r);
+			replayedSum += latency(*h);
+			timed++;
+		}
+		printf("%4zu %14ld %14ld  %-5s %s\n", i + 1, r ? latency(*r) : -1, h ? latency(*h) : -1,
+			match ? "yes" : "NO", printable(r ? r->bytes : h->bytes).c_str());
+		if (!match && r && h)
+			printf("%41s%s\n", "replayed: ", printable(h->bytes).c_str());
+	}
+	printf("\n%zu frames recorded, %zu replayed, %d mismatched\n", recorded.size(), replayed.size(), mismatches);
+	if (timed)
+		printf("mean reply latency: recorded %.0f us, replayed %.0f us\n", recordedSum / timed, replayedSum / timed);
+	fflush(stdout);
+	_exit(mismatches ? 1 : 0);
+}
+
+static std::string unhex(const char *hex)
+{
+	std::string bytes;
+	unsigned int b;
+
+	while (sscanf(hex, "%2x", &b) == 1) {
+		bytes += (char)b;
+		hex += 2;
+	}
+	return bytes;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int link = 0;
+	bool verbose = false, recordedOpen = false, first = true;
+	uint32_t lastRx = 0, start = 0;
+	char line[1024];
+	int opt;
+	FILE *trace;
+
+	while ((opt = getopt(argc, argv, "vl:")) != -1) {
+		if (opt == 'v') {
+			verbose = true;
+		} else if (opt == 'l') {
+			link = atoi(optarg);
+		} else {
+			fprintf(stderr, "usage: %s [-v] [-l link] tracefile\n", argv[0]);
+			return 2;
+		}
+	}
+	if ((optind >= argc) || ((trace = fopen(argv[optind], "r")) == NULL)) {
+		fprintf(stderr, "usage: %s [-v] [-l link] tracefile\n", argv[0]);
+		return 2;
+	}
+
+	while (fgets(line, sizeof(line), trace)) {
+		unsigned long at;
+		unsigned int entryLink;
+		char dir, hex[sizeof(line)] = "";
+		std::string bytes;
+		size_t i;
+
+		if (sscanf(line, "T %lu %u %c %s", &at, &entryLink, &dir, hex) < 3 || (entryLink != link))
+			continue;
+		if (first) {
+			start = at;
+			first = false;
+		}
+		bytes = unhex(hex);
+		if (dir == 'R') {
+			hostLinkQueue(at, bytes);
+			if (!bytes.empty())
+				lastRx = at;
+		} else {
+			for (i = 0; i < bytes.size(); i++)
+				frameByte(recorded, recordedOpen, at, lastRx, bytes[i]);
+		}
+	}
+	fclose(trace);
+
+	/*
+	 * begin() asks for Chariot's status. Unless the trace starts at boot
+	 * and holds that exchange, answer it here so replay starts clean.
+	 */
+	if (recorded.empty() || (recorded[0].bytes.compare(0, 10, "sys/status") != 0)) {
+		hostLinkQueue(--start, "Chariot ready<<");
+	} else {
+		recorded[0].cause = 0;
+	}
+
+	hostClockStart(start);
+	hostLinkTxSink(onTx);
+	hostLinkOnDrained(report);
+	hostMonitor(verbose);
+	if (verbose)
+		ChariotEP.enableDebugMsgs();
+	else
+		ChariotEP.disableDebugMsgs();
+
+	ChariotEP.begin();
+	for (;;) {
+		if (ChariotEP.available())
+			ChariotEP.process();
+		else
+			hostLinkIdle();
+	}
+}